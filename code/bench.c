@@ -0,0 +1,245 @@
+/*
+  Microbenchmarks for the simulation kernels.  Loads a graph and rat
+  file, sets up the initial state as the sequential simulator does, and
+  then times each kernel in isolation over many repetitions.
+
+  The kernels are static functions, so the simulator and utility
+  sources are included directly rather than linked.  That way they get
+  inlined exactly as they are in crun-seq.
+*/
+
+#include <getopt.h>
+
+#include "sim.c"
+#include "rutil.c"
+
+typedef enum { UNIT_NODE, UNIT_EDGE, UNIT_RAT } unit_t;
+
+static char *unit_name[3] = { "node", "edge", "rat" };
+
+/* Keep results live so that the compiler can't drop the kernels */
+static volatile double sink_double = 0.0;
+static volatile int sink_int = 0;
+
+static state_t *s = NULL;
+/* Random targets for locate_value, one per rat */
+static double *rat_target = NULL;
+/* Saved copy of rat seeds, so that every repetition draws the same numbers */
+static random_t *saved_seed = NULL;
+
+static void kernel_imbalance() {
+    graph_t *g = s->g;
+    int nid, eid;
+    double sum = 0.0;
+    for (nid = 0; nid < g->nnode; nid++) {
+	int lcount = s->rat_count[nid];
+	for (eid = g->neighbor_start[nid]+1; eid < g->neighbor_start[nid+1]; eid++)
+	    sum += imbalance(lcount, s->rat_count[g->neighbor[eid]]);
+    }
+    sink_double = sum;
+}
+
+static void kernel_mweight() {
+    graph_t *g = s->g;
+    int nid;
+    double sum = 0.0;
+    for (nid = 0; nid < g->nnode; nid++)
+	sum += mweight((double) s->rat_count[nid]/s->load_factor, BASE_ILF + 0.25 * (nid & 0x3));
+    sink_double = sum;
+}
+
+static void kernel_neighbor_ilf() {
+    graph_t *g = s->g;
+    int nid;
+    double sum = 0.0;
+    for (nid = 0; nid < g->nnode; nid++)
+	sum += neighbor_ilf(s, nid);
+    sink_double = sum;
+}
+
+static void kernel_compute_weights() {
+    compute_all_weights(s);
+}
+
+static void kernel_find_sums() {
+    find_all_sums(s);
+}
+
+static void kernel_locate_value() {
+    graph_t *g = s->g;
+    int r;
+    int sum = 0;
+    for (r = 0; r < s->nrat; r++) {
+	int nid = s->rat_position[r];
+	int estart = g->neighbor_start[nid];
+	int elen = g->neighbor_start[nid+1] - estart;
+	sum += locate_value(rat_target[r], &s->neighbor_accum_weight[estart], elen);
+    }
+    sink_int = sum;
+}
+
+static void kernel_rnext() {
+    int r;
+    random_t sum = 0;
+    memcpy(s->rat_seed, saved_seed, s->nrat * sizeof(random_t));
+    for (r = 0; r < s->nrat; r++)
+	sum += rnext(&s->rat_seed[r], 0);
+    sink_int = (int) sum;
+}
+
+static void kernel_next_random_float() {
+    int r;
+    double sum = 0.0;
+    memcpy(s->rat_seed, saved_seed, s->nrat * sizeof(random_t));
+    for (r = 0; r < s->nrat; r++)
+	sum += next_random_float(&s->rat_seed[r], 1.0);
+    sink_double = sum;
+}
+
+static void kernel_next_move() {
+    int r;
+    int sum = 0;
+    memcpy(s->rat_seed, saved_seed, s->nrat * sizeof(random_t));
+    for (r = 0; r < s->nrat; r++)
+	sum += fast_next_random_move(s, r);
+    sink_int = sum;
+}
+
+typedef struct {
+    char *name;
+    void (*run)();
+    unit_t unit;
+} kernel_t;
+
+static kernel_t kernel_list[] = {
+    { "imbalance", kernel_imbalance, UNIT_EDGE },
+    { "mweight", kernel_mweight, UNIT_NODE },
+    { "neighbor_ilf", kernel_neighbor_ilf, UNIT_NODE },
+    { "compute_all_weights", kernel_compute_weights, UNIT_NODE },
+    { "find_all_sums", kernel_find_sums, UNIT_EDGE },
+    { "locate_value", kernel_locate_value, UNIT_RAT },
+    { "rnext", kernel_rnext, UNIT_RAT },
+    { "next_random_float", kernel_next_random_float, UNIT_RAT },
+    { "fast_next_random_move", kernel_next_move, UNIT_RAT },
+};
+
+#define KERNEL_COUNT (sizeof(kernel_list)/sizeof(kernel_t))
+
+static void usage(char *name) {
+    outmsg("Usage: %s -g GFILE -r RFILE [-n REPS] [-w WARMUP] [-k KERNEL] [-o CSVFILE]\n", name);
+    outmsg("   -h        Print this message\n");
+    outmsg("   -g GFILE  Graph file\n");
+    outmsg("   -r RFILE  Initial rat position file\n");
+    outmsg("   -n REPS   Number of timed repetitions of each kernel (default 100)\n");
+    outmsg("   -w WARMUP Number of untimed repetitions before timing (default 10)\n");
+    outmsg("   -k KERNEL Run only kernels whose name contains KERNEL\n");
+    outmsg("   -o CSVFILE  Write results to CSVFILE rather than stdout\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    char *gname = NULL;
+    char *rname = NULL;
+    char *oname = NULL;
+    char *kname = NULL;
+    int reps = 100;
+    int warmup = 10;
+    int c, i, k;
+    while ((c = getopt(argc, argv, "hg:r:n:w:k:o:")) != -1) {
+	switch (c) {
+	case 'g':
+	    gname = optarg;
+	    break;
+	case 'r':
+	    rname = optarg;
+	    break;
+	case 'n':
+	    reps = atoi(optarg);
+	    break;
+	case 'w':
+	    warmup = atoi(optarg);
+	    break;
+	case 'k':
+	    kname = optarg;
+	    break;
+	case 'o':
+	    oname = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (gname == NULL || rname == NULL || reps < 1)
+	usage(argv[0]);
+    FILE *gfile = fopen(gname, "r");
+    if (gfile == NULL) {
+	outmsg("Couldn't open graph file %s\n", gname);
+	exit(1);
+    }
+    FILE *rfile = fopen(rname, "r");
+    if (rfile == NULL) {
+	outmsg("Couldn't open rat position file %s\n", rname);
+	exit(1);
+    }
+    graph_t *g = read_graph(gfile, 1);
+    fclose(gfile);
+    if (g == NULL || !setup_zone(g, 0, false))
+	exit(1);
+    s = read_rats(g, rfile, DEFAULTSEED);
+    if (s == NULL)
+	exit(1);
+    s->standalone = true;
+    if (!init_zone(s, 0))
+	exit(1);
+    start_state(s);
+    find_all_sums(s);
+
+    rat_target = calloc(s->nrat, sizeof(double));
+    saved_seed = calloc(s->nrat, sizeof(random_t));
+    if (rat_target == NULL || saved_seed == NULL) {
+	outmsg("Couldn't allocate benchmark data\n");
+	exit(1);
+    }
+    memcpy(saved_seed, s->rat_seed, s->nrat * sizeof(random_t));
+    for (i = 0; i < s->nrat; i++) {
+	random_t seed = saved_seed[i];
+	rat_target[i] = next_random_float(&seed, s->sum_weight[s->rat_position[i]]);
+    }
+
+    FILE *outfile = stdout;
+    if (oname != NULL) {
+	outfile = fopen(oname, "w");
+	if (outfile == NULL) {
+	    outmsg("Couldn't open output file %s\n", oname);
+	    exit(1);
+	}
+    }
+    int unit_count[3] = { g->nnode, g->nedge, s->nrat };
+    fprintf(outfile, "kernel,unit,units,reps,ns_per_unit_mean,ns_per_unit_min,ns_per_unit_max\n");
+    for (k = 0; k < KERNEL_COUNT; k++) {
+	kernel_t *kp = &kernel_list[k];
+	if (kname != NULL && strstr(kp->name, kname) == NULL)
+	    continue;
+	for (i = 0; i < warmup; i++)
+	    kp->run();
+	double total = 0.0;
+	double tmin = 0.0;
+	double tmax = 0.0;
+	for (i = 0; i < reps; i++) {
+	    double start = currentSeconds();
+	    kp->run();
+	    double t = currentSeconds() - start;
+	    total += t;
+	    if (i == 0 || t < tmin)
+		tmin = t;
+	    if (t > tmax)
+		tmax = t;
+	}
+	double scale = 1e9 / unit_count[kp->unit];
+	fprintf(outfile, "%s,%s,%d,%d,%.3f,%.3f,%.3f\n", kp->name, unit_name[kp->unit], unit_count[kp->unit], reps,
+		total / reps * scale, tmin * scale, tmax * scale);
+    }
+    if (outfile != stdout)
+	fclose(outfile);
+    return 0;
+}
@@ -8,12 +8,13 @@ import getopt
 import math
 import datetime
 import random
+import json
 
 import rutil
 
 def usage(fname):
     
-    ustring = "Usage: %s [-h][-g][-Q][-I][-b BENCHLIST] [-n NSTEP] [-p P1:P2:..:Pk] [-r RUNS] [-i ID] [-f OUTFILE]" % fname
+    ustring = "Usage: %s [-h][-g][-Q][-I][-b BENCHLIST] [-n NSTEP] [-p P1:P2:..:Pk] [-r RUNS] [-i ID] [-f OUTFILE] [-H HISTFILE] [-c REV[:REV]]" % fname
     print ustring
     print "    -h            Print this message"
     print "    -g            Include mystery benchmarks for grading (Only available to graders)"
@@ -27,6 +28,10 @@ def usage(fname):
     print "    -i ID         Specify unique ID for distinguishing check files"
     print "    -f OUTFILE    Create output file recording measurements"
     print "         If file name contains field of form XX..X, will replace with ID having that many digits"
+    print "    -H HISTFILE   Append results to history file HISTFILE (default %s).  '-' disables history" % historyFileName
+    print "    -c REV        Compare results against those recorded for git revision REV ('last' for most recent other revision)"
+    print "    -c REV1:REV2  Compare recorded results of REV2 against REV1 without running anything"
+    print "         Slowdowns are flagged when significant at level %.2f and larger than %.0f%%" % (significanceLevel, 100 * minimumSlowdown)
     sys.exit(0)
 
 # General information
@@ -50,6 +55,14 @@ referenceFileName = ""
 
 doInstrument = False
 
+# Result history.  One JSON record per benchmark run, keyed by revision, host and configuration
+historyFileName = "./benchmark-history.jsonl"
+# Records from this invocation
+historyList = []
+# Slowdown must pass one-sided Welch t-test at this level, and exceed this fraction
+significanceLevel = 0.05
+minimumSlowdown = 0.02
+
 
 # How many times does each benchmark get run?
 runCount = 3
@@ -180,16 +193,37 @@ def doRun(cmdList, simFileName):
             simFile.close()
         return None
 
-def bestRun(cmdList, simFileName):
-    sofar = 1e6
+# Read per-activity seconds from simulator run report.  Takes the slowest zone for each activity
+def readActivities(reportName):
+    try:
+        rfile = open(reportName, 'r')
+        report = json.load(rfile)
+        rfile.close()
+    except Exception as e:
+        outmsg("Couldn't read run report '%s' (%s)" % (reportName, str(e)))
+        return None
+    activities = {"simulation" : report["seconds"]}
+    for zone in report["zones"]:
+        for name, secs in zone["seconds"].items():
+            activities[name] = max(activities.get(name, 0.0), secs)
+    return activities
+
+# Run command runCount times.  Return list of (seconds, activities) for each run
+def allRuns(cmdList, simFileName, reportName = None):
+    samples = []
     for r in range(runCount):
         if runCount > 1:
             outmsg("Run #%d:" % (r+1), noreturn = True)
         secs = doRun(cmdList, simFileName)
         if secs is None:
             return None
-        sofar = min(sofar, secs)
-    return sofar
+        activities = None
+        if reportName is not None:
+            activities = readActivities(reportName)
+        samples.append((secs, activities))
+    if reportName is not None and os.path.exists(reportName):
+        os.remove(reportName)
+    return samples
 
 def runBenchmark(useRef, testId, stepCount, processCount, machine):
     global referenceFileName, testFileName
@@ -208,8 +242,13 @@ def runBenchmark(useRef, testId, stepCount, processCount, machine):
     if processCount > 1:
         preList = ['mpirun', '-np', str(processCount)] + mpiFlags
     clist = ["-g", graphFile, "-r", ratFile, "-n", str(stepCount)]
+    reportName = None
     if doInstrument:
         clist += ["-I"]
+        # Reference solutions don't produce run reports
+        if not useRef:
+            reportName = "benchmark-report-%d.json" % os.getpid()
+            clist += ["-J", reportName]
     simFileName = None
     if not useRef:
         name = testName(testId, stepCount, defaultSeed, processCount)
@@ -230,16 +269,223 @@ def runBenchmark(useRef, testId, stepCount, processCount, machine):
     else:
         clist += ["-q"]
     cmd = preList + [prog] + clist
-    secs = bestRun(cmd, simFileName)
-    if secs is None:
+    samples = allRuns(cmd, simFileName, reportName)
+    if samples is None:
         return None
     else:
+        secs = min([t for (t, activities) in samples])
         rmoves = (nodes * load) * stepCount
         npm = 1e9 * secs/rmoves
         results.append("%.1f" % secs)
         results.append("%.1f" % npm)
+        if not useRef:
+            recordHistory(tname, stepCount, processCount, machine, rmoves, samples)
         return results
 
+def gitRevision():
+    try:
+        rev = subprocess.check_output(["git", "rev-parse", "--short", "HEAD"], stderr = subprocess.STDOUT).strip()
+        status = subprocess.check_output(["git", "status", "--porcelain", "--untracked-files=no"], stderr = subprocess.STDOUT)
+    except Exception as e:
+        return "unknown"
+    if status.strip() != "":
+        rev += "-dirty"
+    return rev
+
+revision = None
+
+def recordHistory(tname, stepCount, processCount, machine, rmoves, samples):
+    global revision
+    if revision is None:
+        revision = gitRevision()
+    record = {"time" : datetime.datetime.now().strftime("%Y-%m-%d %H:%M:%S"),
+              "revision" : revision, "host" : os.uname()[1], "machine" : machine,
+              "benchmark" : tname, "steps" : stepCount, "procs" : processCount,
+              "instrument" : doInstrument, "load" : loadFactor,
+              "npm" : [1e9 * secs / rmoves for (secs, activities) in samples]}
+    if doInstrument and None not in [activities for (secs, activities) in samples]:
+        names = sorted(samples[0][1].keys())
+        record["activities"] = dict([(n, [activities[n] for (secs, activities) in samples]) for n in names])
+    historyList.append(record)
+    if historyFileName == "-":
+        return
+    try:
+        hfile = open(historyFileName, "a")
+        hfile.write(json.dumps(record, sort_keys = True) + "\n")
+        hfile.close()
+    except Exception as e:
+        outmsg("Couldn't append to history file '%s' (%s)" % (historyFileName, str(e)))
+
+def loadHistory():
+    records = []
+    try:
+        hfile = open(historyFileName, "r")
+    except Exception as e:
+        return records
+    for line in hfile:
+        line = line.strip()
+        if line == "":
+            continue
+        try:
+            records.append(json.loads(line))
+        except ValueError:
+            outmsg("Skipping malformed history record")
+    hfile.close()
+    return records
+
+# Records are comparable when they were measured the same way on the same machine
+def configKey(record):
+    return (record["host"], record["benchmark"], record["steps"], record["procs"], record["instrument"], record["load"])
+
+def matchRevision(record, rev):
+    return record["revision"] == rev or record["revision"].startswith(rev)
+
+# Regularized incomplete beta function I_x(a,b), by continued fraction
+def betaContinued(a, b, x):
+    tiny = 1e-30
+    c = 1.0
+    d = 1.0 - (a+b) * x / (a+1)
+    if abs(d) < tiny:
+        d = tiny
+    d = 1.0/d
+    h = d
+    for m in range(1, 200):
+        m2 = 2*m
+        aa = m * (b-m) * x / ((a+m2-1) * (a+m2))
+        d = 1.0 + aa*d
+        if abs(d) < tiny:
+            d = tiny
+        c = 1.0 + aa/c
+        if abs(c) < tiny:
+            c = tiny
+        d = 1.0/d
+        h *= d*c
+        aa = -(a+m) * (a+b+m) * x / ((a+m2) * (a+m2+1))
+        d = 1.0 + aa*d
+        if abs(d) < tiny:
+            d = tiny
+        c = 1.0 + aa/c
+        if abs(c) < tiny:
+            c = tiny
+        d = 1.0/d
+        delta = d*c
+        h *= delta
+        if abs(delta-1.0) < 1e-12:
+            break
+    return h
+
+def betaIncomplete(a, b, x):
+    if x <= 0.0:
+        return 0.0
+    if x >= 1.0:
+        return 1.0
+    lbeta = math.lgamma(a+b) - math.lgamma(a) - math.lgamma(b) + a * math.log(x) + b * math.log(1.0-x)
+    if x < (a+1) / (a+b+2):
+        return math.exp(lbeta) * betaContinued(a, b, x) / a
+    else:
+        return 1.0 - math.exp(lbeta) * betaContinued(b, a, 1.0-x) / b
+
+def meanVariance(vals):
+    n = len(vals)
+    mean = sum(vals) / n
+    var = sum([(v-mean)**2 for v in vals]) / (n-1) if n > 1 else 0.0
+    return (mean, var)
+
+# One-sided Welch t-test that newVals are larger than oldVals.  Returns p-value
+def slowdownProbability(oldVals, newVals):
+    if len(oldVals) < 2 or len(newVals) < 2:
+        return None
+    omean, ovar = meanVariance(oldVals)
+    nmean, nvar = meanVariance(newVals)
+    ose = ovar / len(oldVals)
+    nse = nvar / len(newVals)
+    if ose + nse == 0.0:
+        return 0.0 if nmean > omean else 1.0
+    t = (nmean - omean) / math.sqrt(ose + nse)
+    df = (ose + nse)**2 / (ose**2 / (len(oldVals)-1) + nse**2 / (len(newVals)-1))
+    # Upper tail of Student's t distribution
+    tail = 0.5 * betaIncomplete(0.5 * df, 0.5, df / (df + t*t))
+    return tail if t > 0 else 1.0 - tail
+
+def compareMetric(name, metric, oldVals, newVals):
+    omean = sum(oldVals) / len(oldVals)
+    nmean = sum(newVals) / len(newVals)
+    change = (nmean - omean) / omean if omean > 0 else 0.0
+    p = slowdownProbability(oldVals, newVals)
+    flag = ""
+    if p is not None and p < significanceLevel and change > minimumSlowdown:
+        flag = "SLOWER"
+    pstring = "--" if p is None else "%.3f" % p
+    outmsg("\t".join([name, metric, "%.4g" % omean, "%.4g" % nmean, "%+.1f%%" % (100 * change), pstring, flag]))
+    return flag != ""
+
+# Compare each of newRecords against all oldRecords with same configuration.  Returns number of slowdowns
+def compareRecords(oldRecords, newRecords, oldRev, newRev):
+    outmsg("+++++++++++++++++ Comparing %s against %s" % (newRev, oldRev))
+    outmsg("\t".join(["Name", "metric", "old", "new", "change", "p", ""]))
+    slowCount = 0
+    groups = {}
+    for r in newRecords:
+        groups.setdefault(configKey(r), []).append(r)
+    for key in sorted(groups.keys()):
+        newList = groups[key]
+        oldList = [r for r in oldRecords if configKey(r) == key]
+        name = "%sx%.2d" % (key[1], key[3])
+        if len(oldList) == 0:
+            outmsg("%s\tno results for %s" % (name, oldRev))
+            continue
+        oldNpm = sum([r["npm"] for r in oldList], [])
+        newNpm = sum([r["npm"] for r in newList], [])
+        if compareMetric(name, "NPM", oldNpm, newNpm):
+            slowCount += 1
+        oldAct = [r["activities"] for r in oldList if "activities" in r]
+        newAct = [r["activities"] for r in newList if "activities" in r]
+        if len(oldAct) == 0 or len(newAct) == 0:
+            continue
+        for act in sorted(newAct[0].keys()):
+            oldVals = sum([a.get(act, []) for a in oldAct], [])
+            newVals = sum([a.get(act, []) for a in newAct], [])
+            # Skip activities that don't occur in this configuration
+            if len(oldVals) == 0 or max(oldVals + newVals) == 0.0:
+                continue
+            if compareMetric(name, act, oldVals, newVals):
+                slowCount += 1
+    if slowCount > 0:
+        outmsg("%d significant slowdowns" % slowCount)
+    else:
+        outmsg("No significant slowdowns")
+    return slowCount
+
+# Expand revision prefix to full name.  Revision 'last' means most recent revision in history, other than excluded one
+def resolveRevision(records, rev, exclude):
+    for r in reversed(records):
+        if rev == "last" and r["revision"] != exclude:
+            return r["revision"]
+        if rev != "last" and matchRevision(r, rev):
+            return r["revision"]
+    return None if rev == "last" else rev
+
+def compareHistory(oldRev, newRev):
+    records = loadHistory()
+    if newRev is None:
+        if len(historyList) == 0:
+            outmsg("No results to compare")
+            return
+        newRecords = historyList
+        newRev = revision
+    else:
+        newRev = resolveRevision(records, newRev, None)
+        newRecords = [r for r in records if matchRevision(r, newRev)]
+    oldRev = resolveRevision(records, oldRev, newRev)
+    if oldRev is None:
+        outmsg("No earlier revision in history file '%s'" % historyFileName)
+        return
+    oldRecords = [r for r in records if matchRevision(r, oldRev) and r not in historyList]
+    if len(newRecords) == 0:
+        outmsg("No results for revision %s" % newRev)
+        return
+    compareRecords(oldRecords, newRecords, oldRev, newRev)
+
 def score(npm, rnpm):
     if npm == 0.0:
         return 0
@@ -336,6 +582,7 @@ def run(name, args):
     global uniqueId
     global runCount
     global doInstrument
+    global historyFileName
     nstep = defaultSteps
     testList = None
     machine = 'x'
@@ -353,7 +600,8 @@ def run(name, args):
         outmsg("Warning: Host = '%s'. Can only get comparison results on GHC or Latedays machine" % host)
     processCounts = defaultProcessCountsDict[machine]
 
-    optString = "hQIgb:n:p:r:i:f:"
+    compareRevs = None
+    optString = "hQIgb:n:p:r:i:f:H:c:"
     optlist, args = getopt.getopt(args, optString)
     for (opt, val) in optlist:
         if opt == '-h':
@@ -378,6 +626,14 @@ def run(name, args):
             runCount = int(val)
         elif opt == '-i':
             uniqueId = val
+        elif opt == '-H':
+            historyFileName = val
+        elif opt == '-c':
+            compareRevs = val.split(":")
+            if len(compareRevs) > 2:
+                print("Compare with REV or REV1:REV2")
+                usage(name)
+                return
         elif opt == '-f':
             fname = generateFileName(val)
             try:
@@ -405,6 +661,10 @@ def run(name, args):
             outmsg("Unknown option '%s'" % opt)
             usage(name)
     
+    if compareRevs is not None and len(compareRevs) == 2:
+        compareHistory(compareRevs[0], compareRevs[1])
+        return
+
     if testList is None:
         testList = sorted(benchmarkDict.keys())
 
@@ -422,5 +682,8 @@ def run(name, args):
         secs = delta.seconds + 24 * 3600 * delta.days + 1e-6 * delta.microseconds
         print("Overall test time = %.1f secs." % (secs))
 
+    if compareRevs is not None:
+        compareHistory(compareRevs[0], None)
+
 if __name__ == "__main__":
     run(sys.argv[0], sys.argv[1:])
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <getopt.h>
+#include <sys/resource.h>
 
 #include "crun.h"
 
@@ -11,21 +12,149 @@ static void full_exit(int code) {
     exit(code);
 }
 
+/* Read graph from file gname, or generate it according to gspec when that is given */
+static graph_t *input_graph(char *gname, char *gspec, int nzone) {
+    if (gspec != NULL) {
+	int width, height;
+	int nregion = DEFAULT_REGIONS;
+	int expansion = 0;
+	random_t seed = DEFAULT_GRAPH_SEED;
+	if (!parse_graph_spec(gspec, &width, &height, &nregion, &seed, &expansion))
+	    return NULL;
+	return generate_graph(width, height, nregion, expansion, seed, nzone);
+    }
+    FILE *gfile = fopen(gname, "r");
+    if (gfile == NULL) {
+	outmsg("Couldn't open graph file %s\n", gname);
+	return NULL;
+    }
+    graph_t *g = read_graph(gfile, nzone);
+    fclose(gfile);
+    return g;
+}
+
+/* Read rats from file rname, or generate them according to rspec when that is given */
+static state_t *input_rats(graph_t *g, char *rname, char *rspec, random_t global_seed) {
+    if (rspec != NULL) {
+	rat_mode_t mode;
+	int load, nrat;
+	random_t seed = DEFAULTSEED;
+	if (!parse_rat_spec(rspec, &mode, &load, &seed))
+	    return NULL;
+	int *position = generate_rat_positions(g, mode, load, seed, &nrat);
+	if (position == NULL)
+	    return NULL;
+	state_t *s = place_rats(g, position, nrat, global_seed);
+	free(position);
+	return s;
+    }
+    FILE *rfile = fopen(rname, "r");
+    if (rfile == NULL) {
+	outmsg("Couldn't open rat position file %s\n", rname);
+	return NULL;
+    }
+    return read_rats(g, rfile, global_seed);
+}
+
+/* Write string as JSON, with quotes */
+static void json_string(FILE *f, char *str) {
+    fputc('"', f);
+    for (; str != NULL && *str; str++) {
+	unsigned char c = *str;
+	if (c == '"' || c == '\\')
+	    fprintf(f, "\\%c", c);
+	else if (c == '\n')
+	    fprintf(f, "\\n");
+	else if (c == '\t')
+	    fprintf(f, "\\t");
+	else if (c < 0x20)
+	    fprintf(f, "\\u%04x", c);
+	else
+	    fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+/*
+  Write JSON report of run to file jname.  Must be called by all
+  processes.  Peak RSS is in KB, as reported by getrusage
+*/
+static void write_report(char *jname, char *gname, char *rname, graph_t *g, state_t *s,
+			 int steps, random_t seed, int nzone, double secs) {
+    struct rusage usage;
+    long rss = 0;
+    long max_rss, total_rss;
+    FILE *f = NULL;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+	rss = usage.ru_maxrss;
+#if MPI
+    MPI_Reduce(&rss, &max_rss, 1, MPI_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&rss, &total_rss, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+#else
+    max_rss = total_rss = rss;
+#endif
+    if (g->this_zone == 0) {
+	f = fopen(jname, "w");
+	if (f == NULL)
+	    outmsg("Couldn't open report file %s\n", jname);
+    }
+    if (f != NULL) {
+	fprintf(f, "{\n  \"parameters\": {\"graph\": ");
+	json_string(f, gname);
+	fprintf(f, ", \"rats\": ");
+	json_string(f, rname);
+	fprintf(f, ", \"steps\": %d, \"seed\": %u, \"processes\": %d, \"batch_size\": %d},\n",
+		steps, (unsigned) seed, nzone, s->batch_size);
+	fprintf(f, "  \"graph\": {\"width\": %d, \"height\": %d, \"nodes\": %d, \"edges\": %d, \"regions\": %d, \"zones\": %d},\n",
+		g->width, g->height, g->nnode, g->nedge, g->nregion, g->nzone);
+	fprintf(f, "  \"nrat\": %d,\n  \"seconds\": %.6f,\n", s->nrat, secs);
+	fprintf(f, "  \"rat_moves_per_second\": %.1f,\n", secs > 0 ? (double) s->nrat * steps / secs : 0.0);
+	fprintf(f, "  \"peak_rss_kb\": {\"max\": %ld, \"total\": %ld}", max_rss, total_rss);
+    }
+    REPORT_ACTIVITY(f, g->local_node_count, g->local_edge_count);
+    if (f != NULL) {
+	fprintf(f, "\n}\n");
+	fclose(f);
+    }
+}
+
 static void usage(char *name) {
 #if MPI
-    char *use_string = "-g GFILE -r RFILE [-n STEPS] [-s SEED] [-q] [-i INT] [-I]";
+    char *use_string = "(-g GFILE | -G SPEC) (-r RFILE | -L SPEC) [-n STEPS] [-s SEED] [-q] [-i INT] [-I] [-t] [-c] [-T TFILE] [-J JFILE] [-o FMT] [-a DEPTH] [-d] [-D TILE] [-S] [-H LEVEL] [-C HFILE] [-O OFILE] [-W] [-B K] [-P] [-V] [-M MFILE]";
 #else // !MPI
-    char *use_string = "-g GFILE -r RFILE [-n STEPS] [-s SEED] [-q] [-i INT] [-I] [-z ZONE]";
+    char *use_string = "(-g GFILE | -G SPEC) (-r RFILE | -L SPEC) [-n STEPS] [-s SEED] [-q] [-i INT] [-I] [-t] [-c] [-T TFILE] [-J JFILE] [-o FMT] [-a DEPTH] [-d] [-D TILE] [-S] [-H LEVEL] [-C HFILE] [-z ZONE]";
 #endif
     outmsg("Usage: %s %s\n", name, use_string);
     outmsg("   -h        Print this message\n");
     outmsg("   -g GFILE  Graph file\n");
     outmsg("   -r RFILE  Initial rat position file\n");
+    outmsg("   -G SPEC   Generate hlbrt graph WxH[:REGIONS[:SEED[:EXPANSION]]] rather than reading file (default %d regions, seed %d)\n",
+	   DEFAULT_REGIONS, DEFAULT_GRAPH_SEED);
+    outmsg("   -L SPEC   Generate LOAD rats per node MLOAD[:SEED] rather than reading file.  M: r(andom), u(niform), d(iagonal), c(enter)\n");
     outmsg("   -n STEPS  Number of simulation steps\n");
     outmsg("   -s SEED   Initial RNG seed\n");
     outmsg("   -q        Operate in quiet mode.  Do not generate simulation results\n");
     outmsg("   -i INT    Display update interval\n");
     outmsg("   -I        Instrument simulation activities\n");
+    outmsg("   -t        With -I, also show time in each activity for every step\n");
+    outmsg("   -c        With -I, also count cycles, instructions, and cache misses for each activity\n");
+    outmsg("   -T TFILE  Write timeline of activities and messages to TFILE, in Chrome trace format.  Implies -I\n");
+    outmsg("   -J JFILE  Write report of parameters, times, and memory use to JFILE as JSON.  Implies -I\n");
+    outmsg("   -o FMT    Output format: text (default), binary (delta encoded), or binary-abs\n");
+    outmsg("   -a DEPTH  Write output from background thread, buffering up to DEPTH frames\n");
+    outmsg("   -d        With -a, drop frames rather than wait when buffer is full\n");
+    outmsg("   -D TILE   Show total counts of TILE x TILE squares rather than of every node\n");
+    outmsg("   -S        Show only summary statistics of node counts for each step.  Text output only\n");
+    outmsg("   -H LEVEL  Show only 64-bit hash of state for each step.  1: node counts  2: also rat positions.  Text output only\n");
+    outmsg("   -C HFILE  Check hash of state for each step against HFILE, as generated with -H (default level 2)\n");
+#if MPI
+    outmsg("   -O OFILE  Write raw binary frames to OFILE, with every process writing its own zone\n");
+    outmsg("   -W        Exchange boundary values with zones on the same host through shared memory\n");
+    outmsg("   -B K      Rebalance zones according to measured load every K steps\n");
+    outmsg("   -P        Load graph and rat files with all processes reading in parallel\n");
+    outmsg("   -V        Validate every batch against sequential run by process 0\n");
+    outmsg("   -M MFILE  Count messages, bytes, and rats sent between zones.  Write CSV to MFILE (- for none).  Implies -I\n");
+#endif
 #if !MPI
     outmsg("   -z ZONE   Test partitioning into ZONE zones without running simulation");
 #endif
@@ -33,8 +162,12 @@ static void usage(char *name) {
 }
 
 int main(int argc, char *argv[]) {
-    FILE *gfile = NULL;
-    FILE *rfile = NULL;
+    char *gname = NULL;
+    char *rname = NULL;
+    char *gspec = NULL;
+    char *rspec = NULL;
+    char *tname = NULL;
+    FILE *tfile = NULL;
     int steps = 1;
     int dinterval = 1;
     random_t global_seed = DEFAULTSEED;
@@ -43,12 +176,29 @@ int main(int argc, char *argv[]) {
     graph_t *g = NULL;
     state_t *s = NULL;
     bool instrument = false;
+    bool instrument_steps = false;
+    bool instrument_counters = false;
+    char *tlname = NULL;
+    char *cname = NULL;
+    char *jname = NULL;
     bool display = true;
+    output_t output_format = OUTPUT_TEXT;
+    int writer_depth = 0;
+    bool drop_frames = false;
+    int display_tile = 0;
+    bool display_stats = false;
+    int display_hash = 0;
     bool show_zones_only = false;
     int process_count = 1;
     int this_zone = 0;
     int nzone = 0;
 #if MPI
+    char *oname = NULL;
+    bool validate = false;
+    bool shared_exchange = false;
+    bool parallel_load = false;
+    int rebalance_interval = 0;
+
     MPI_Init(NULL, NULL);
     MPI_Comm_size(MPI_COMM_WORLD, &process_count);
     MPI_Comm_rank(MPI_COMM_WORLD, &this_zone);
@@ -57,9 +207,9 @@ int main(int argc, char *argv[]) {
 #endif
     bool mpi_master = this_zone == 0;
 #if MPI
-    char *optstring = "hg:r:R:n:s:i:qI";
+    char *optstring = "hg:r:G:L:R:n:s:i:qItcT:J:o:a:dD:SH:C:O:WB:PVM:";
 #else
-    char *optstring = "hg:r:R:n:s:i:qIz:";
+    char *optstring = "hg:r:G:L:R:n:s:i:qItcT:J:o:a:dD:SH:C:z:";
 #endif
     while ((c = getopt(argc, argv, optstring)) != -1) {
         switch(c) {
@@ -68,20 +218,16 @@ int main(int argc, char *argv[]) {
             usage(argv[0]);
             break;
         case 'g':
-            if (!mpi_master) break;
-            gfile = fopen(optarg, "r");
-            if (gfile == NULL) {
-                outmsg("Couldn't open graph file %s\n", optarg);
-		full_exit(1);
-            }
+            gname = optarg;
             break;
         case 'r':
-            if (!mpi_master) break;
-            rfile = fopen(optarg, "r");
-            if (rfile == NULL) {
-                outmsg("Couldn't open rat position file %s\n", optarg);
-                full_exit(1);
-            }
+            rname = optarg;
+            break;
+        case 'G':
+            gspec = optarg;
+            break;
+        case 'L':
+            rspec = optarg;
             break;
         case 'n':
             steps = atoi(optarg);
@@ -98,6 +244,72 @@ int main(int argc, char *argv[]) {
         case 'I':
             instrument = true;
             break;
+        case 't':
+            instrument_steps = true;
+            break;
+        case 'c':
+            instrument_counters = true;
+            break;
+        case 'T':
+            tlname = optarg;
+            instrument = true;
+            break;
+        case 'J':
+            jname = optarg;
+            instrument = true;
+            break;
+        case 'o':
+            if (strcmp(optarg, "text") == 0)
+                output_format = OUTPUT_TEXT;
+            else if (strcmp(optarg, "binary") == 0)
+                output_format = OUTPUT_BINARY;
+            else if (strcmp(optarg, "binary-abs") == 0)
+                output_format = OUTPUT_BINARY_ABS;
+            else {
+                if (!mpi_master) break;
+                outmsg("Unknown output format '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'a':
+            writer_depth = atoi(optarg);
+            break;
+        case 'd':
+            drop_frames = true;
+            break;
+        case 'D':
+            display_tile = atoi(optarg);
+            break;
+        case 'S':
+            display_stats = true;
+            break;
+        case 'H':
+            display_hash = atoi(optarg);
+            break;
+        case 'C':
+            tname = optarg;
+            break;
+#if MPI
+        case 'O':
+            oname = optarg;
+            break;
+        case 'W':
+            shared_exchange = true;
+            break;
+        case 'B':
+            rebalance_interval = atoi(optarg);
+            break;
+        case 'P':
+            parallel_load = true;
+            break;
+        case 'V':
+            validate = true;
+            break;
+        case 'M':
+            cname = optarg;
+            instrument = true;
+            break;
+#endif
 #if !MPI
 	case 'z':
 	    nzone = atoi(optarg);
@@ -111,19 +323,64 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    /* Summary and hash lines are text, and can't be mixed into a binary frame stream */
+    if ((display_stats || display_hash > 0) && output_format != OUTPUT_TEXT) {
+	if (mpi_master) {
+	    outmsg("Summary statistics (-S) and state hashes (-H) require text output format");
+	    usage(argv[0]);
+	}
+	full_exit(1);
+    }
+
+#if !MPI
+    /* Sequential simulator runs whole graph as single zone */
+    if (!show_zones_only)
+	nzone = 1;
+#endif
+
     TRACK_ACTIVITY(instrument);
+    TRACK_STEPS(instrument_steps);
+    if (instrument)
+	TRACK_COUNTERS(instrument_counters);
+    if (tlname != NULL)
+	TRACK_TIMELINE(tlname);
+    if (cname != NULL)
+	TRACK_COMM(strcmp(cname, "-") == 0 ? NULL : cname);
     START_ACTIVITY(ACTIVITY_STARTUP);
 
     if (mpi_master) {
-      	if (gfile == NULL) {
+      	if (gname == NULL && gspec == NULL) {
 	    outmsg("Need graph file\n");
 	    usage(argv[0]);
 	}
-	if (rfile == NULL && !show_zones_only) {
+	if (rname == NULL && rspec == NULL && !show_zones_only) {
 	    outmsg("Need initial rat position file\n");
 	    usage(argv[0]);
 	}
-	g = read_graph(gfile, nzone);
+    }
+
+#if MPI
+    /* Generated inputs are always built by the master and distributed */
+    if (parallel_load && gspec == NULL && rspec == NULL) {
+	/* All processes read parts of the files, keeping only what their zones need */
+	if (gname == NULL || rname == NULL)
+	    full_exit(1);
+	g = load_graph(gname, nzone, rebalance_interval > 0);
+	if (g == NULL)
+	    full_exit(1);
+	if (!setup_zone(g, this_zone, false))
+	    full_exit(1);
+	s = load_rats(g, rname, global_seed);
+	if (s == NULL)
+	    full_exit(1);
+	if (!init_zone(s, this_zone)) {
+	    outmsg("Couldn't allocate space for zone %d data structures.  Exiting", this_zone);
+	    full_exit(0);
+	}
+    } else
+#endif
+    if (mpi_master) {
+	g = input_graph(gname, gspec, nzone);
 	if (g == NULL) {
 	    full_exit(1);
 	}
@@ -140,39 +397,50 @@ int main(int argc, char *argv[]) {
 	    full_exit(0);
 	}
 
-	s = read_rats(g, rfile, global_seed);
+	s = input_rats(g, rname, rspec, global_seed);
 	if (s == NULL) {
 	    full_exit(1);
 	}
 
 #if MPI
-        /* Master distributes the graph to the other processors */
-	send_graph(g);
-	if (!setup_zone(g, this_zone, false))
-	    full_exit(1);
-        /* Master distributes rats to the other processors */
-	send_rats(s);
+	if (rebalance_interval > 0) {
+	    /* Rebalancing needs the whole graph and all rats in every process */
+	    send_graph(g);
+	    if (!setup_zone(g, this_zone, false))
+		full_exit(1);
+	    send_rats(s);
+	} else {
+	    /* Master distributes each zone of the graph, and its rats, to its processor */
+	    if (!send_zone_graphs(g))
+		full_exit(1);
+	    send_zone_rats(s);
+	}
 	// * Distribute copy of rats to other zones
 	if (!init_zone(s, this_zone)) {
 	    outmsg("Couldn't allocate space for zone %d data structures.  Exiting", this_zone);
 	    full_exit(0);
         }
+#else
+	if (!setup_zone(g, this_zone, false) || !init_zone(s, this_zone)) {
+	    outmsg("Couldn't allocate space for zone data structures.  Exiting");
+	    full_exit(1);
+	}
 #endif
     } else {
 	/* The other nodes receive the graph from the master */
 
 #if MPI
-	g = get_graph();
+	g = rebalance_interval > 0 ? get_graph() : get_zone_graph();
 	if (g == NULL) {
 	    outmsg("No graph.  Exiting");
 	    full_exit(0);
 	}
-	if (!setup_zone(g, this_zone, false)) {
+	if (rebalance_interval > 0 && !setup_zone(g, this_zone, false)) {
 	    outmsg("Couldn't set up zones.  Exiting");
 	    full_exit(0);
 	}
 	/* The other nodes receive the rats from the master */
-	s = get_rats(g, global_seed);
+	s = rebalance_interval > 0 ? get_rats(g, global_seed) : get_zone_rats(g, global_seed);
 	if (s == NULL) {
 	    outmsg("No rats.  Exiting");
 	    full_exit(0);
@@ -185,6 +453,52 @@ int main(int argc, char *argv[]) {
 #endif
     }
 
+#if MPI
+    s->rebalance_interval = rebalance_interval;
+    if (shared_exchange && !setup_shared_exchange(s)) {
+	outmsg("Couldn't set up shared memory exchange.  Exiting");
+	full_exit(1);
+    }
+    if (display && oname != NULL && !open_shared_output(oname, g, s->nrat))
+	full_exit(1);
+    if (validate && mpi_master) {
+	/* Shadow run reads (or generates) its inputs on its own, with the plain sequential loader */
+	graph_t *sg = NULL;
+	state_t *shadow = NULL;
+	if ((sg = input_graph(gname, gspec, 1)) != NULL
+	    && setup_zone(sg, 0, false) && (shadow = input_rats(sg, rname, rspec, global_seed)) != NULL) {
+	    shadow->standalone = true;
+	    if (!init_zone(shadow, 0))
+		shadow = NULL;
+	}
+	if (shadow == NULL) {
+	    outmsg("Couldn't set up sequential run for validation.  Exiting");
+	    MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	s->shadow = shadow;
+    }
+    s->validate = validate;
+#endif
+    if (tname != NULL) {
+	if (mpi_master) {
+	    tfile = fopen(tname, "r");
+	    if (tfile == NULL) {
+		outmsg("Couldn't open hash trace file %s\n", tname);
+		full_exit(1);
+	    }
+	}
+	s->trace_file = tfile;
+	s->check_trace = true;
+    }
+
+    s->display_tile = display_tile;
+    s->display_stats = display_stats;
+    s->display_hash = display_hash;
+    if (mpi_master && display && !set_output_format(output_format, g->nnode))
+	full_exit(1);
+    if (mpi_master && display && writer_depth > 0 && !start_writer(g->nnode, writer_depth, drop_frames))
+	full_exit(1);
+
     FINISH_ACTIVITY(ACTIVITY_STARTUP);
 
     if (mpi_master)
@@ -194,10 +508,16 @@ int main(int argc, char *argv[]) {
 	secs = simulate(s, steps, dinterval, display);
     if (mpi_master)
 	outmsg("%d steps, %d rats, %.3f seconds\n", steps, s->nrat, secs);
+    if (mpi_master && (s->validate || s->check_trace) && !s->diverged)
+	outmsg("Validation passed\n");
 
     SHOW_ACTIVITY(stderr, g->local_node_count, g->local_edge_count);
+    WRITE_TIMELINE();
+    if (jname != NULL)
+	write_report(jname, gspec != NULL ? gspec : gname, rspec != NULL ? rspec : rname,
+		     g, s, steps, global_seed, process_count, secs);
 #if MPI
     MPI_Finalize();
 #endif    
-    return 0;
+    return s->diverged ? 1 : 0;
 }
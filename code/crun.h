@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
@@ -52,10 +53,22 @@
 /* What is the crossover between binary and linear search */
 #define BINARY_THRESHOLD 4
 
+/* How many buckets in histogram of node counts for summary statistics.  Bucket k > 0 holds counts in [2^(k-1), 2^k) */
+#define STAT_BUCKETS 32
+
+/* What fraction must rebalancing cut from the busiest zone's load before regions are migrated */
+#define REBALANCE_GAIN 0.05
+
 
 /* Update modes */
 typedef enum { UPDATE_SYNCHRONOUS, UPDATE_BATCH, UPDATE_RAT } update_t;
 
+/* Output formats.  Binary formats are varint encoded, with or without deltas between frames */
+typedef enum { OUTPUT_TEXT, OUTPUT_BINARY, OUTPUT_BINARY_ABS } output_t;
+
+/* Initial rat distributions for generated inputs, in the order used by gengraph.py */
+typedef enum { RAT_RANDOM, RAT_UNIFORM, RAT_DIAGONAL, RAT_CENTER } rat_mode_t;
+
 /* All information needed for graphrat simulation */
 
 /* Parameter abbreviations
@@ -67,6 +80,19 @@ typedef enum { UPDATE_SYNCHRONOUS, UPDATE_BATCH, UPDATE_RAT } update_t;
    Z = number of zones
  */
 
+/* Representation of a region.  Used by partitioner */
+typedef struct {
+	int id;
+	int x;  // Left X
+	int y;  // Upper Y
+	int w;  // Width
+	int h;  // Height
+	int node_count;  // Number of nodes
+	int edge_count;  // Number of (directed edges)
+	int zone_id;     // Zone assigned by partitioner
+} region_t;
+
+
 /* Representation of graph */
 typedef struct {
 	/* General parameters */
@@ -78,11 +104,15 @@ typedef struct {
 
 	/* Graph structure representation */
 	// Adjacency lists.  Includes self edge. Length=M+N.  Combined into single vector
+	// (When process only holds its own zone, has only lists of local nodes)
 	int *neighbor;
 	// Starting index for each adjacency list.  Length=N+1
 	int *neighbor_start;
 	// For each node, zone identifier (number between 0 and Z-1).  Length=N
 	int *zone_id;
+	// Regions, with their current zone assignments.  Length=K
+	int nregion;
+	region_t *region_list;
 #if STATIC_ILF
 	// NOTE: This data removed.  ILFs are computed dynamically
 	// Ideal load factor for each node.  (This value gets read from file but is not used.)  Length=N
@@ -109,7 +139,7 @@ typedef struct {
 } graph_t;
 
 /* Representation of simulation state */
-typedef struct {
+typedef struct state {
 	graph_t *g;
 
 	/* Number of rats */
@@ -120,7 +150,7 @@ typedef struct {
 	random_t global_seed;
 
 	/* State representation */
-	// Node Id for each rat.  Length=R
+	// Node Id for each rat.  Length=R.  (-1 for rats never seen by this zone)
 	int *rat_position;
 	// Rat seeds.  Length = R
 	random_t *rat_seed;
@@ -144,6 +174,27 @@ typedef struct {
 	//int zone_rat_count; // number of rats in zone
 	int *zone_rat_list; // list of rid in the zone. Length = nrat
 	unsigned char *zone_rat_bitvector; // bitvector for each rat's membership in the zone
+
+	// Repartition zones every rebalance_interval steps.  0 = never
+	int rebalance_interval;
+
+	// Display counts summed over display_tile x display_tile squares.  0 = show every node
+	int display_tile;
+	// Display only summary statistics of counts
+	bool display_stats;
+	// Display only hash of state.  1 = hash counts, 2 = also hash rat positions.  0 = off
+	int display_hash;
+
+	// Simulated by this process alone, without exchanging anything with other zones
+	bool standalone;
+	// Check state after every batch against a shadow sequential run, held by process 0
+	bool validate;
+	struct state *shadow;
+	// Check hash of state after every step against trace of earlier run, read by process 0
+	bool check_trace;
+	FILE *trace_file;
+	// Set once results diverge
+	bool diverged;
 	
 	// Have storage for buffers you use to communicate with other zones.
 
@@ -151,10 +202,6 @@ typedef struct {
 	//int *import_numrats;  
 	int *export_numrats; 
 
-	// nid per rat in each zone. Length = nzone * nrat
-	int **import_nid; 
-	int **export_nid;
-
 	// rid per rat in each zone. Length = nzone * nrat
 	int **import_rat_info;
 	int **export_rat_info;
@@ -163,40 +210,48 @@ typedef struct {
 	//random_t **import_seed;
 	//random_t **export_seed;
 
-	// int **import_node_id
-	// # number of rats per node for each zone. Length = nzone * nnode
-	int **import_rat_count; 
-	int **export_rat_count;
-
-	// # number of nodes per zone. Length = nzone * nnode
+	// Counts of boundary nodes for each zone.  Length of each = import/export node count of zone
+	// Also serve as the last counts exchanged with each zone, against which changes are encoded
 	int **import_node_state;
 	int **export_node_state;
 
-	// weight per node for each zone. Length = nzone * nnode 
+	// (index, count) pairs for boundary nodes whose counts changed since last exchange.  Sized as above
+	int **import_node_delta;
+	int **export_node_delta;
+
+	// Weights of boundary nodes for each zone.  Sized as above
 	double **import_node_weight; 
 	double **export_node_weight;
 
 	int* zone_node_id;
-	int* export_node_id;
-	int* export_node_count;
-		
-} state_t;
 
+	// Gathering counts on process 0 for display.  Node ids are registered once per zone setup
+	// Nodes gathered from each zone, and offset of each zone's nodes.  Length = Z (process 0 only)
+	int *display_zone_count;
+	int *display_zone_offset;
+	// Node ids of all nodes gathered, in zone order.  Length = N (process 0 only)
+	int *display_node_id;
+	// Gathered counts on process 0 (Length = N), or counts to send (Length = local node count)
+	int *display_count;
 
-	
-/* Representation of a region.  Used by partitioner */
-typedef struct {
-	int id;
-	int x;  // Left X
-	int y;  // Upper Y
-	int w;  // Width
-	int h;  // Height
-	int node_count;  // Number of nodes
-	int edge_count;  // Number of (directed edges)
-	int zone_id;     // Zone assigned by partitioner
-} region_t;
+#if MPI
+	/* Exchange with zones on the same host through an MPI-3 shared memory window */
+	bool shared_exchange;
+	// Processes on this host
+	MPI_Comm node_comm;
+	// Window holding node_weight and rat_count of every process on this host
+	MPI_Win node_win;
+	// For each zone, its rank in node_comm, or -1 if it runs on another host.  Length = nzone
+	int *node_rank;
+	// For each zone on this host, its rat counts and node weights mapped into our address space.  Length = nzone
+	int **peer_rat_count;
+	double **peer_node_weight;
+#endif
+
+} state_t;
 
 
+	
 /*** Function in partition.c ***/
 /*
   This function should assign a zone id to every region in the graph.
@@ -209,6 +264,13 @@ typedef struct {
 */
 void assign_zones(region_t *region_list, int nregion, int nzone);
 
+/*
+  Reassign zones to regions according to measured region costs,
+  given as one weight per region.  Used to rebalance the load while
+  the simulation is running.
+*/
+void reassign_zones(region_t *region_list, int nregion, int nzone, double *region_weight);
+
 /*** Functions in graph.c. ***/
 graph_t *new_graph(int width, int height, int nedge, int nzone);
 
@@ -216,6 +278,9 @@ void free_graph();
 
 graph_t *read_graph(FILE *gfile, int nzone);
 
+/* Attach regions to graph and partition them into zones.  Return false if partitioning fails */
+bool add_regions(graph_t *g, region_t *region_list, int nregion, int nzone);
+
 #if DEBUG
 void show_graph(graph_t *g);
 #endif
@@ -223,6 +288,15 @@ void show_graph(graph_t *g);
 #if MPI
 void send_graph(graph_t *g);
 graph_t *get_graph();
+
+/* Distribute to each process only its own zone of the graph */
+/* Return false if something goes wrong */
+bool send_zone_graphs(graph_t *g);
+graph_t *get_zone_graph();
+
+/* Load graph file with all processes reading parts of it in parallel */
+/* When whole is false, each process only keeps adjacency lists for its zone */
+graph_t *load_graph(char *fname, int nzone, bool whole);
 #endif
 
 bool setup_zone(graph_t *g, int this_zone, bool verbose);
@@ -239,6 +313,9 @@ double *double_alloc(size_t n);
 /* Read rat file and initialize simulation state */
 state_t *read_rats(graph_t *g, FILE *infile, random_t global_seed);
 
+/* Initialize simulation state with rats at given positions */
+state_t *place_rats(graph_t *g, int *position, int nrat, random_t global_seed);
+
 /* Comparison function for qsort */
 int comp_int(const void *ap, const void *bp);
 
@@ -249,6 +326,77 @@ void done(state_t *s);
 /* show_counts indicates whether to include counts of rats for each node */
 void show(state_t *s, bool show_counts);
 
+/* Print state downsampled into tiles holding the total count of their nodes */
+/* Under MPI, called by all processes, with output by process 0 */
+void show_tiles(state_t *s, bool show_counts);
+
+/* Print one line of summary statistics of node counts for step */
+/* Under MPI, called by all processes, with output by process 0 */
+void show_stats(state_t *s, int step);
+
+/* Compute 64-bit hash of node counts, and at level 2 also of rat positions */
+/* Under MPI, called by all processes (unless standalone), with result valid in process 0 */
+uint64_t hash_state(state_t *s, int level);
+
+/* Print hash of state for step */
+/* Under MPI, called by all processes, with output by process 0 */
+void show_hash(state_t *s, int step);
+
+/* Compare hash of state for step with next entry of trace.  Under MPI, called by all processes */
+void check_trace(state_t *s, int step);
+
+/*** Functions in generate.c ***/
+
+/* Defaults for generated graphs, matching those of fractal.py and gengraph.py */
+#define DEFAULT_REGIONS 100
+#define DEFAULT_GRAPH_SEED 418
+
+/* Generate hlbrt graph, as fractal.py and gengraph.py would, partitioned into nzone zones */
+/* Expansion 0 chooses a factor that divides both dimensions */
+graph_t *generate_graph(int width, int height, int nregion, int expansion, random_t seed, int nzone);
+
+/* Parse specifications WxH[:REGIONS[:SEED[:EXPANSION]]] and MLOAD[:SEED].  Fields not given keep their values */
+bool parse_graph_spec(char *spec, int *width, int *height, int *nregion, random_t *seed, int *expansion);
+bool parse_rat_spec(char *spec, rat_mode_t *mode, int *load, random_t *seed);
+
+/* Generate initial rat positions.  Return array of them, with length in *nratp */
+int *generate_rat_positions(graph_t *g, rat_mode_t mode, int load, random_t seed, int *nratp);
+
+/* Write graph and rat files in the formats read by read_graph and read_rats */
+bool write_graph(FILE *outfile, graph_t *g, random_t seed);
+bool write_rats(FILE *outfile, int nnode, int *position, int nrat, rat_mode_t mode, int load, random_t seed);
+
+/*** Functions in output.c ***/
+
+/* Choose output format.  Return false if cannot allocate buffers */
+bool set_output_format(output_t format, int nnode);
+
+/* Print frame for one step.  counts == NULL when not showing counts */
+void write_frame(int width, int height, int nrat, int *counts);
+
+/* Mark end of output */
+void write_done();
+
+/* Start background thread to write frames, buffering up to depth of them */
+/* When drop is set, newer frames replace waiting ones rather than blocking the simulator */
+/* Return false if cannot start writer */
+bool start_writer(int nnode, int depth, bool drop);
+
+/* Output frame, through writer if one is running.  counts == NULL when not showing counts */
+void emit_frame(int width, int height, int nrat, int *counts);
+
+/* Write remaining frames and stop writer */
+void finish_writer();
+
+#if MPI
+/* Write binary frames to a shared file, each process writing its own zone's counts */
+/* All of these are collective.  Return false if cannot open file */
+bool open_shared_output(char *fname, graph_t *g, int nrat);
+bool shared_output_active();
+void write_shared_frame(state_t *s, bool show_counts);
+void close_shared_output(state_t *s);
+#endif
+
 /*** Functions in sim.c ***/
 
 /* Run simulation.  Return elapsed time in seconds */
@@ -274,6 +422,24 @@ void send_rats(state_t *s);
 /* Called by other nodes to get rat state from master and set up state data structure */
 state_t *get_rats(graph_t *g, random_t global_seed);
 
+/* Read the lines of a file that start within this process's byte range */
+char *read_chunk(char *fname);
+
+/* Split next line off of chunk */
+char *chunk_line(char **pos);
+
+/* True if ok is true in every process */
+bool all_ok(bool ok);
+
+/* Load rat file in parallel, giving each process the rats in its zone */
+state_t *load_rats(graph_t *g, char *fname, random_t global_seed);
+
+/* Called by process 0 to distribute to each zone only the rats residing in it */
+void send_zone_rats(state_t *s);
+
+/* Called by other nodes to get the rats in their zones from master and set up state data structure */
+state_t *get_zone_rats(graph_t *g, random_t global_seed);
+
 /* Move rats between zones as they migrate */
 void exchange_rats(state_t *s);
 
@@ -283,6 +449,16 @@ void exchange_node_states(state_t *s);
 /* Exchange weights of nodes on boundaries */
 void exchange_node_weights(state_t *s);
 
+/* Move rat counts and node weights into a shared window so zones on the same host can read them directly */
+/* Return false if cannot set up window */
+bool setup_shared_exchange(state_t *s);
+/* Release shared window and node communicator.  Collective */
+void free_shared_exchange(state_t *s);
+
+/* Repartition regions according to measured load and migrate rats to their new zones */
+/* Return true if the zone assignment changed */
+bool rebalance_zones(state_t *s);
+
 #endif // MPI
 
 
@@ -7,6 +7,7 @@
   #else
     #include <mach/mach.h>
     #include <mach/mach_time.h>
+    #include <time.h>
   #endif // __x86_64__ or not
 
 
@@ -16,6 +17,7 @@
 #else
   #include <string.h>
   #include <sys/time.h>
+  #include <time.h>
 #endif
 
 #include <stdio.h>  // fprintf
@@ -39,106 +41,68 @@
   // scaling) or if you are in a heterogenous environment, you will
   // likely get spurious results.
 
-typedef uint64_t SysClock;
-
     //////////
     // Return the current CPU time, in terms of clock ticks.
     // Time zero is at some arbitrary point in the past.
-static SysClock currentTicks() {
-    //#if defined(__APPLE__) && !defined(__x86_64__)
+    // On x86-64, currentTicks is inlined from cycletimer.h
+#if !(defined(__x86_64__) && !defined(_WIN32))
+uint64_t currentTicks() {
 #if defined(__APPLE__)
       return mach_absolute_time();
 #elif defined(_WIN32)
       LARGE_INTEGER qwTime;
       QueryPerformanceCounter(&qwTime);
       return qwTime.QuadPart;
-#elif defined(__x86_64__)
-      unsigned int a, d;
-      asm volatile("rdtsc" : "=a" (a), "=d" (d));
-      return ((uint64_t) d << 32) + a;
-#elif defined(__ARM_NEON__) && 0 // mrc requires superuser.
-      unsigned int val;
-      asm volatile("mrc p15, 0, %0, c9, c13, 0" : "=r"(val));
-      return val;
 #else
-      timespec spec;
-      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &spec);
+      struct timespec spec;
+      clock_gettime(CLOCK_MONOTONIC, &spec);
       return (uint64_t) spec.tv_sec * 1000 * 1000 * 1000 + spec.tv_nsec;
 #endif
 }
+#endif
+
+#if !defined(_WIN32) && !(defined(__APPLE__) && !defined(__x86_64__))
+//////////
+// Measure tick rate against the monotonic system clock over 10 ms.
+// The nominal frequency in /proc/cpuinfo need not match the rate of
+// the timestamp counter.
+static double calibrateTicks() {
+    struct timespec start, now;
+    double elapsed;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t startTicks = currentTicks();
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - start.tv_sec) + 1e-9 * (now.tv_nsec - start.tv_nsec);
+    } while (elapsed < 0.01);
+    uint64_t ticks = currentTicks() - startTicks;
+    if (ticks == 0) {
+	fprintf(stderr, "cycletimer failed: clock not advancing\n");
+	exit(-1);
+    }
+    return elapsed / (double) ticks;
+}
+#endif
 
 //////////
 // Return the conversion from ticks to seconds.
-static double secondsPerTick() {
+double secondsPerTick() {
     static bool initialized = false;
     static double secondsPerTick_val;
     if (initialized) return secondsPerTick_val;
-#if defined(__APPLE__)
-    #if 0
-    //  #ifdef __x86_64__
-    int args[] = {CTL_HW, HW_CPU_FREQ};
-    unsigned int Hz;
-    size_t len = sizeof(Hz);
-    if (sysctl(args, 2, &Hz, &len, NULL, 0) != 0) {
-	fprintf(stderr, "Failed to initialize secondsPerTick_val!\n");
-	exit(-1);
-    }
-    secondsPerTick_val = 1.0 / (double) Hz;
-#else
+#if defined(_WIN32)
+      LARGE_INTEGER qwTicksPerSec;
+      QueryPerformanceFrequency(&qwTicksPerSec);
+      secondsPerTick_val = 1.0/(double) qwTicksPerSec.QuadPart;
+#elif defined(__APPLE__) && !defined(__x86_64__)
     mach_timebase_info_data_t time_info;
     mach_timebase_info(&time_info);
 
     // Scales to nanoseconds without 1e-9f
     secondsPerTick_val = (1e-9 * (double) time_info.numer)/(double) time_info.denom;
-#endif // x86_64 or not
-#elif defined(_WIN32)
-      LARGE_INTEGER qwTicksPerSec;
-      QueryPerformanceFrequency(&qwTicksPerSec);
-      secondsPerTick_val = 1.0/(double) qwTicksPerSec.QuadPart;
 #else
-      FILE *fp = fopen("/proc/cpuinfo","r");
-      char input[1024];
-      if (!fp) {
-         fprintf(stderr, "cycletimer failed: couldn't find /proc/cpuinfo.");
-         exit(-1);
-      }
-      // In case we don't find it, e.g. on the N900
-      secondsPerTick_val = 1e-9;
-      while (!feof(fp) && fgets(input, 1024, fp)) {
-	  // NOTE(boulos): Because reading cpuinfo depends on dynamic
-	  // frequency scaling it's better to read the @ sign first
-	  float GHz, MHz;
-	  if (strstr(input, "model name")) {
-	      char* at_sign = strstr(input, "@");
-	      if (at_sign) {
-		  char* after_at = at_sign + 1;
-		  char* GHz_str = strstr(after_at, "GHz");
-		  char* MHz_str = strstr(after_at, "MHz");
-		  if (GHz_str) {
-		      *GHz_str = '\0';
-		      if (1 == sscanf(after_at, "%f", &GHz)) {
-			  //printf("GHz = %f\n", GHz);
-			  secondsPerTick_val = 1e-9f / GHz;
-			  break;
-		      }
-		  } else if (MHz_str) {
-		      *MHz_str = '\0';
-		      if (1 == sscanf(after_at, "%f", &MHz)) {
-			  //printf("MHz = %f\n", MHz);
-			  secondsPerTick_val = 1e-6f / GHz;
-			  break;
-		      }
-		  }
-	      }
-	  } else if (1 == sscanf(input, "cpu MHz : %f", &MHz)) {
-	      //printf("MHz = %f\n", MHz);
-	      secondsPerTick_val = 1e-6f / MHz;
-	      break;
-	  }
-      }
-      fclose(fp);
+      secondsPerTick_val = calibrateTicks();
 #endif
-      
       initialized = true;
       return secondsPerTick_val;
 }
@@ -1,6 +1,26 @@
 #ifndef CYCLETIMER_H
 /* Cycle timer code, adapted from CycleTimer.h found in 15-418 code repositories */
+#include <stdint.h>
 
 double currentSeconds();
+
+/*
+  Timestamp in clock ticks, from some arbitrary point in the past.  On
+  x86-64 this reads the processor timestamp counter directly, taking
+  only a few nanoseconds.  secondsPerTick() gives the conversion,
+  calibrated against the system clock on first use.
+*/
+#if defined(__x86_64__) && !defined(_WIN32)
+static inline uint64_t currentTicks() {
+    unsigned int a, d;
+    __asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
+    return ((uint64_t) d << 32) + a;
+}
+#else
+uint64_t currentTicks();
+#endif
+
+double secondsPerTick();
+
 #define CYCLETIMER_H
 #endif
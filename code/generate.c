@@ -0,0 +1,527 @@
+/*
+  Generation of hlbrt graphs and initial rat positions, as done by
+  fractal.py and gengraph.py.  The same seeds give the same graphs and
+  rat files as the Python generator, but without writing (or parsing)
+  any files, so that very large inputs can be built in memory.
+
+  The region tree is a Hilbert tree: each split divides a node in half,
+  with the orientation of the halves following the Hilbert curve.  Each
+  leaf of the tree, scaled by the expansion factor, becomes a region of
+  the grid, with one to three hub nodes connected to every other node
+  in the region.
+*/
+
+#include <time.h>
+
+#include "crun.h"
+
+/* Hilbert node types and split directions, as in fractal.py */
+typedef enum { HT_A, HT_B, HT_C, HT_D, HT_A1, HT_A2, HT_B1, HT_B2, HT_C1, HT_C2, HT_D1, HT_D2, HT_NONE } htype_t;
+typedef enum { SPLIT_RIGHT, SPLIT_LEFT, SPLIT_UP, SPLIT_DOWN } split_t;
+
+/* For each Hilbert type: how to split it, and types of the two children */
+static int split_rule[12][3] = {
+    { SPLIT_RIGHT, HT_A1, HT_A2 },
+    { SPLIT_DOWN,  HT_B1, HT_B2 },
+    { SPLIT_LEFT,  HT_C1, HT_C2 },
+    { SPLIT_UP,    HT_D1, HT_D2 },
+
+    { SPLIT_UP,    HT_D,  HT_A },
+    { SPLIT_DOWN,  HT_A,  HT_B },
+    { SPLIT_LEFT,  HT_C,  HT_B },
+    { SPLIT_RIGHT, HT_B,  HT_A },
+    { SPLIT_DOWN,  HT_B,  HT_C },
+    { SPLIT_UP,    HT_C,  HT_D },
+    { SPLIT_RIGHT, HT_A,  HT_D },
+    { SPLIT_LEFT,  HT_D,  HT_C },
+};
+
+/* Hub placement parameters, as in gengraph.py */
+#define MAX_HUBS 3
+#define MIN_ASPECT 2.0
+
+/* Range of ideal load factors */
+#define ILF_LOW 1.2
+#define ILF_HIGH 1.8
+
+/* Expansion factors to try, in order of preference */
+static int expansion_list[] = { 5, 8, 4, 2, 1 };
+
+typedef struct {
+    int x, y, w, h;
+    htype_t htype;
+    int parent;
+    int child[2];
+    bool leaf;
+} tnode_t;
+
+typedef struct {
+    tnode_t *node;
+    int nnode;
+    int cap;
+    random_t seed;
+    bool nomem;
+} tree_t;
+
+/* Random integer in [lower, upper], as RNG.randInt in rutil.py */
+static int rand_int(random_t *seedp, int lower, int upper) {
+    double rval = next_random_float(seedp, 1.0);
+    return lower + (int) (rval * (upper + 1 - lower));
+}
+
+/* Caller must make sure there is room for the node */
+static int new_tnode(tree_t *t, int x, int y, int w, int h, htype_t htype, int parent) {
+    tnode_t *n = &t->node[t->nnode];
+    n->x = x; n->y = y; n->w = w; n->h = h;
+    n->htype = htype;
+    n->parent = parent;
+    n->leaf = true;
+    return t->nnode++;
+}
+
+static int max_power2(int x) {
+    int val = 0;
+    if (x == 0)
+	return 0;
+    while (x % 2 == 0) {
+	val++;
+	x /= 2;
+    }
+    return val;
+}
+
+/* Attempt to split node.  Return false if it can't be split, or on allocation failure */
+static bool branch(tree_t *t, int nid) {
+    if (t->nnode + 2 > t->cap) {
+	tnode_t *node = realloc(t->node, 2 * t->cap * sizeof(tnode_t));
+	if (node == NULL) {
+	    t->nomem = true;
+	    return false;
+	}
+	t->node = node;
+	t->cap *= 2;
+    }
+    tnode_t *n = &t->node[nid];
+    if (n->htype == HT_NONE && n->parent < 0) {
+	/* Fresh root.  Choose type that matches its shape */
+	int wp2 = max_power2(n->w);
+	int hp2 = max_power2(n->h);
+	htype_t base = wp2 > hp2 ? HT_B1 : wp2 < hp2 ? HT_A1 : HT_A;
+	int idx = rand_int(&t->seed, 0, 3);
+	if (base == HT_A)
+	    n->htype = HT_A + idx;
+	else
+	    /* (A1, A2, C1, C2) or (B1, B2, D1, D2) */
+	    n->htype = base + (idx & 0x1) + 4 * (idx >> 1);
+    }
+    int st = split_rule[n->htype][0];
+    htype_t ht0 = split_rule[n->htype][1];
+    htype_t ht1 = split_rule[n->htype][2];
+    int x = n->x, y = n->y, w = n->w, h = n->h;
+    int c0, c1;
+    switch (st) {
+    case SPLIT_LEFT:
+	if (w % 2 != 0)
+	    return false;
+	c0 = new_tnode(t, x + w/2, y, w/2, h, ht0, nid);
+	c1 = new_tnode(t, x, y, w/2, h, ht1, nid);
+	break;
+    case SPLIT_RIGHT:
+	if (w % 2 != 0)
+	    return false;
+	c0 = new_tnode(t, x, y, w/2, h, ht0, nid);
+	c1 = new_tnode(t, x + w/2, y, w/2, h, ht1, nid);
+	break;
+    case SPLIT_DOWN:
+	if (h % 2 != 0)
+	    return false;
+	c0 = new_tnode(t, x, y, w, h/2, ht0, nid);
+	c1 = new_tnode(t, x, y + h/2, w, h/2, ht1, nid);
+	break;
+    default:
+	if (h % 2 != 0)
+	    return false;
+	c0 = new_tnode(t, x, y + h/2, w, h/2, ht0, nid);
+	c1 = new_tnode(t, x, y, w, h/2, ht1, nid);
+	break;
+    }
+    n->leaf = false;
+    n->child[0] = c0;
+    n->child[1] = c1;
+    return true;
+}
+
+/*
+  Split randomly chosen leaves until reaching target number of leaves.
+  Each leaf is chosen with equal weight, as FractalTree.generateTree with
+  default exponents.  Like fractal.py, fail if all leaves become too small
+  to split before reaching the target.
+*/
+static bool generate_tree(tree_t *t, int width, int height, int target, random_t seed) {
+    t->cap = 64;
+    t->nnode = 0;
+    t->nomem = false;
+    t->node = calloc(t->cap, sizeof(tnode_t));
+    int *leaf_set = int_alloc(target + 2);
+    if (t->node == NULL || leaf_set == NULL) {
+	outmsg("Couldn't allocate space for region tree\n");
+	return false;
+    }
+    reseed(&t->seed, &seed, 1);
+    int nleaf = 0;
+    leaf_set[nleaf++] = new_tnode(t, 0, 0, width, height, HT_NONE, -1);
+    while (nleaf > 0 && nleaf < target) {
+	double cval = next_random_float(&t->seed, (double) nleaf);
+	int idx = (int) cval;
+	if (idx >= nleaf)
+	    idx = nleaf-1;
+	int nid = leaf_set[idx];
+	memmove(&leaf_set[idx], &leaf_set[idx+1], (nleaf - idx - 1) * sizeof(int));
+	nleaf--;
+	if (branch(t, nid)) {
+	    leaf_set[nleaf++] = t->node[nid].child[0];
+	    leaf_set[nleaf++] = t->node[nid].child[1];
+	} else if (t->nomem) {
+	    outmsg("Couldn't allocate space for region tree\n");
+	    free(leaf_set);
+	    return false;
+	}
+    }
+    free(leaf_set);
+    if (nleaf == 0) {
+	outmsg("Failed to generate tree\n");
+	free(t->node);
+	return false;
+    }
+    return true;
+}
+
+/* Append leaves below node, in order, as FractalNode.leafList */
+static void collect_leaves(tree_t *t, int nid, int expansion, region_t *region_list, int *nregion) {
+    tnode_t *n = &t->node[nid];
+    if (n->leaf) {
+	region_t *r = &region_list[(*nregion)++];
+	r->x = n->x * expansion; r->y = n->y * expansion;
+	r->w = n->w * expansion; r->h = n->h * expansion;
+	return;
+    }
+    collect_leaves(t, n->child[0], expansion, region_list, nregion);
+    collect_leaves(t, n->child[1], expansion, region_list, nregion);
+}
+
+/* Fill in hub node IDs for region.  Return number of hubs */
+static int hub_list(int width, region_t *r, int *hub) {
+    int cx = r->x + r->w/2;
+    int cy = r->y + r->h/2;
+    int dx = r->w/(MAX_HUBS+1);
+    int dy = r->h/(MAX_HUBS+1);
+    int i;
+    if (r->h >= MIN_ASPECT * r->w && r->h > MAX_HUBS && dy > 1) {
+	for (i = 0; i < MAX_HUBS; i++)
+	    hub[i] = (r->y + (i+1)*dy) * width + cx;
+	return MAX_HUBS;
+    }
+    if (r->w >= MIN_ASPECT * r->h && r->w > MAX_HUBS && dx > 1) {
+	for (i = 0; i < MAX_HUBS; i++)
+	    hub[i] = cy * width + r->x + (i+1)*dx;
+	return MAX_HUBS;
+    }
+    hub[0] = cy * width + cx;
+    return 1;
+}
+
+/* Insert value into short sorted list, unless already there.  Return new length */
+static inline int insert_unique(int *list, int len, int val) {
+    int i = len;
+    while (i > 0 && list[i-1] > val)
+	i--;
+    if (i > 0 && list[i-1] == val)
+	return len;
+    memmove(&list[i+1], &list[i], (len - i) * sizeof(int));
+    list[i] = val;
+    return len+1;
+}
+
+/*
+  Fill list with neighbors of nid, in ascending order, not including
+  nid itself.  List must have room for the region plus the grid
+  neighbors when nid is a hub.  Return number of neighbors.
+*/
+static int node_neighbors(graph_t *g, int nid, int *region_of, int *hubs, int *hub_count, int *list) {
+    int width = g->width;
+    int x = nid % width;
+    int y = nid / width;
+    int rid = region_of[nid];
+    region_t *r = &g->region_list[rid];
+    int *hub = &hubs[MAX_HUBS * rid];
+    int nhub = hub_count[rid];
+    int len = 0;
+    int i;
+    bool is_hub = false;
+    for (i = 0; i < nhub; i++)
+	is_hub = is_hub || hub[i] == nid;
+    if (is_hub) {
+	/* Hubs connect to every node in region, plus grid neighbors outside it */
+	int rx, ry;
+	if (y > 0 && region_of[nid-width] != rid)
+	    list[len++] = nid-width;
+	for (ry = r->y; ry < r->y + r->h; ry++) {
+	    if (ry == y && x > 0 && region_of[nid-1] != rid)
+		list[len++] = nid-1;
+	    for (rx = r->x; rx < r->x + r->w; rx++) {
+		int id = ry * width + rx;
+		if (id != nid)
+		    list[len++] = id;
+	    }
+	    if (ry == y && x < width-1 && region_of[nid+1] != rid)
+		list[len++] = nid+1;
+	}
+	if (y < g->height-1 && region_of[nid+width] != rid)
+	    list[len++] = nid+width;
+	return len;
+    }
+    if (y > 0)
+	list[len++] = nid-width;
+    if (x > 0)
+	list[len++] = nid-1;
+    if (x < width-1)
+	list[len++] = nid+1;
+    if (y < g->height-1)
+	list[len++] = nid+width;
+    for (i = 0; i < nhub; i++)
+	len = insert_unique(list, len, hub[i]);
+    return len;
+}
+
+/*
+  Generate width x height hlbrt graph, with regions partitioned into
+  nzone zones.  Each tree cell becomes expansion x expansion nodes.
+  When expansion is 0, uses the first of 5, 8, 4, 2, 1 that divides
+  both dimensions.  Return NULL if something goes wrong.
+*/
+graph_t *generate_graph(int width, int height, int nregion, int expansion, random_t seed, int nzone) {
+    int i, rid;
+    for (i = 0; expansion == 0 && i < sizeof(expansion_list)/sizeof(int); i++) {
+	if (width % expansion_list[i] == 0 && height % expansion_list[i] == 0)
+	    expansion = expansion_list[i];
+    }
+    if (width % expansion != 0 || height % expansion != 0) {
+	outmsg("Graph dimensions %d x %d are not multiples of expansion factor %d\n", width, height, expansion);
+	return NULL;
+    }
+    tree_t t;
+    if (!generate_tree(&t, width/expansion, height/expansion, nregion, seed))
+	return NULL;
+    /* Tree has one more leaf than it has interior nodes */
+    region_t *region_list = calloc((t.nnode+1)/2, sizeof(region_t));
+    if (region_list == NULL) {
+	outmsg("Couldn't allocate space for region list\n");
+	return NULL;
+    }
+    nregion = 0;
+    collect_leaves(&t, 0, expansion, region_list, &nregion);
+    free(t.node);
+
+    int nnode = width * height;
+    int *region_of = int_alloc(nnode);
+    int *hubs = int_alloc(MAX_HUBS * nregion);
+    int *hub_count = int_alloc(nregion);
+    int max_region = 0;
+    if (region_of == NULL || hubs == NULL || hub_count == NULL) {
+	outmsg("Couldn't allocate space to generate graph\n");
+	return NULL;
+    }
+    for (rid = 0; rid < nregion; rid++) {
+	region_t *r = &region_list[rid];
+	int rx, ry;
+	for (ry = r->y; ry < r->y + r->h; ry++)
+	    for (rx = r->x; rx < r->x + r->w; rx++)
+		region_of[ry * width + rx] = rid;
+	hub_count[rid] = hub_list(width, r, &hubs[MAX_HUBS * rid]);
+	if (r->w * r->h > max_region)
+	    max_region = r->w * r->h;
+    }
+
+    /* Count edges, then build adjacency lists in place.  Shape holds what node_neighbors needs */
+    graph_t shape;
+    shape.width = width;
+    shape.height = height;
+    shape.region_list = region_list;
+    int *list = int_alloc(max_region + 4 + MAX_HUBS);
+    if (list == NULL) {
+	outmsg("Couldn't allocate space to generate graph\n");
+	return NULL;
+    }
+    long nedge = 0;
+    int nid;
+    for (nid = 0; nid < nnode; nid++)
+	nedge += node_neighbors(&shape, nid, region_of, hubs, hub_count, list);
+    if (nedge + nnode > INT32_MAX) {
+	outmsg("Graph with %ld edges is too large\n", nedge);
+	return NULL;
+    }
+    graph_t *g = new_graph(width, height, (int) nedge, nzone);
+    if (g == NULL)
+	return NULL;
+    int eid = 0;
+    for (nid = 0; nid < nnode; nid++) {
+	g->neighbor_start[nid] = eid;
+	g->neighbor[eid++] = nid;
+	eid += node_neighbors(&shape, nid, region_of, hubs, hub_count, &g->neighbor[eid]);
+    }
+    g->neighbor_start[nnode] = eid;
+    free(list);
+    free(region_of);
+    free(hubs);
+    free(hub_count);
+    if (!add_regions(g, region_list, nregion, nzone))
+	return NULL;
+    outmsg("Generated graph with %d nodes, %d edges, and %d regions\n", nnode, g->nedge, nregion);
+    return g;
+}
+
+/*
+  Parse graph specification of form WxH[:REGIONS[:SEED[:EXPANSION]]].
+  Return false if malformed.
+*/
+bool parse_graph_spec(char *spec, int *width, int *height, int *nregion, random_t *seed, int *expansion) {
+    unsigned long useed = *seed;
+    int n = sscanf(spec, "%dx%d:%d:%lu:%d", width, height, nregion, &useed, expansion);
+    if (n < 2 || *width <= 0 || *height <= 0 || *nregion <= 0 || *expansion < 0) {
+	outmsg("Invalid graph specification '%s'.  Expecting WxH[:REGIONS[:SEED[:EXPANSION]]]\n", spec);
+	return false;
+    }
+    *seed = (random_t) useed;
+    return true;
+}
+
+/*
+  Parse rat specification of form MLOAD[:SEED], where M is one of
+  r(andom), u(niform), d(iagonal), or c(enter).  Return false if malformed.
+*/
+bool parse_rat_spec(char *spec, rat_mode_t *mode, int *load, random_t *seed) {
+    unsigned long useed = *seed;
+    char *modes = "rudc";
+    char *pos = strchr(modes, spec[0]);
+    if (spec[0] == 0 || pos == NULL || sscanf(spec+1, "%d:%lu", load, &useed) < 1 || *load <= 0) {
+	outmsg("Invalid rat specification '%s'.  Expecting MLOAD[:SEED], with M one of r, u, d, c\n", spec);
+	return false;
+    }
+    *mode = (rat_mode_t) (pos - modes);
+    *seed = (random_t) useed;
+    return true;
+}
+
+/*
+  Generate initial rat positions, as Graph.makeRats in gengraph.py with
+  a freshly seeded generator.  Return array of positions, and set *nratp
+  to its length, or return NULL if something goes wrong.
+*/
+int *generate_rat_positions(graph_t *g, rat_mode_t mode, int load, random_t seed, int *nratp) {
+    int nnode = g->nnode;
+    long rat_count = (long) nnode * load;
+    random_t rseed;
+    int i, r, c;
+    reseed(&rseed, &seed, 1);
+    if (rat_count > INT32_MAX) {
+	outmsg("Can't generate %ld rats\n", rat_count);
+	return NULL;
+    }
+    int nrat = (int) rat_count;
+    int *position = NULL;
+    if (mode == RAT_RANDOM) {
+	position = int_alloc(nrat);
+	if (position == NULL) {
+	    outmsg("Couldn't allocate space for %d rats\n", nrat);
+	    return NULL;
+	}
+	for (r = 0; r < nrat; r++)
+	    position[r] = rand_int(&rseed, 0, nnode-1);
+	*nratp = nrat;
+	return position;
+    }
+
+    /* Other modes repeat a list of starting nodes, and then permute it */
+    int *start = int_alloc(nnode);
+    int nstart = 0;
+    if (start == NULL) {
+	outmsg("Couldn't allocate space for rat positions\n");
+	return NULL;
+    }
+    if (mode == RAT_UNIFORM) {
+	for (i = 0; i < nnode; i++)
+	    start[nstart++] = i;
+    } else if (mode == RAT_DIAGONAL) {
+	if (g->width >= g->height) {
+	    double aspect = (double) g->height / g->width;
+	    for (c = 0; c < g->width; c++)
+		start[nstart++] = (int) (aspect * c) * g->width + c;
+	} else {
+	    double aspect = (double) g->width / g->height;
+	    for (r = 0; r < g->height; r++)
+		start[nstart++] = r * g->width + (int) (aspect * r);
+	}
+    } else {
+	start[nstart++] = (g->height/2) * g->width + g->width/2;
+    }
+    nrat = nstart * (nrat / nstart);
+    position = int_alloc(nrat);
+    int *perm = int_alloc(nrat);
+    if (position == NULL || perm == NULL) {
+	outmsg("Couldn't allocate space for %d rats\n", nrat);
+	return NULL;
+    }
+    for (i = 0; i < nrat; i++)
+	perm[i] = i;
+    for (i = nrat; i > 1; i--) {
+	int idx = rand_int(&rseed, 0, i-1);
+	int tmp = perm[idx];
+	perm[idx] = perm[i-1];
+	perm[i-1] = tmp;
+    }
+    for (i = 0; i < nrat; i++)
+	position[i] = start[perm[i] % nstart];
+    free(start);
+    free(perm);
+    *nratp = nrat;
+    return position;
+}
+
+static char *rat_mode_name[4] = { "random", "uniform", "diagonal", "center" };
+
+/*
+  Write graph in text format.  Ideal load factors are drawn with seed, as
+  gengraph.py -s does.  This is separate from the seed for the region tree
+*/
+bool write_graph(FILE *outfile, graph_t *g, random_t seed) {
+    random_t gseed;
+    int nid, eid;
+    time_t now = time(NULL);
+    reseed(&gseed, &seed, 1);
+    fprintf(outfile, "# Generated %s", ctime(&now));
+    fprintf(outfile, "# Parameters: ilf = (%.2f,%.2f), seed = %u\n", ILF_LOW, ILF_HIGH, (unsigned) seed);
+    fprintf(outfile, "# Width Height Edges Regions\n");
+    fprintf(outfile, "%d %d %d %d\n", g->width, g->height, g->nedge, g->nregion);
+    for (nid = 0; nid < g->nnode; nid++)
+	fprintf(outfile, "n %d %.5f\n", nid, ILF_LOW + next_random_float(&gseed, ILF_HIGH - ILF_LOW));
+    for (nid = 0; nid < g->nnode; nid++)
+	for (eid = g->neighbor_start[nid]+1; eid < g->neighbor_start[nid+1]; eid++)
+	    fprintf(outfile, "e %d %d\n", nid, g->neighbor[eid]);
+    for (nid = 0; nid < g->nregion; nid++) {
+	region_t *r = &g->region_list[nid];
+	fprintf(outfile, "r %d %d %d %d\n", r->x, r->y, r->w, r->h);
+    }
+    return !ferror(outfile);
+}
+
+/* Write rat file */
+bool write_rats(FILE *outfile, int nnode, int *position, int nrat, rat_mode_t mode, int load, random_t seed) {
+    int r;
+    time_t now = time(NULL);
+    fprintf(outfile, "%d %d\n", nnode, nrat);
+    fprintf(outfile, "# Generated %s", ctime(&now));
+    fprintf(outfile, "# Parameters: load = %d, mode = %s, seed = %u\n", load, rat_mode_name[mode], (unsigned) seed);
+    for (r = 0; r < nrat; r++)
+	fprintf(outfile, "%d\n", position[r]);
+    return !ferror(outfile);
+}
@@ -0,0 +1,109 @@
+/*
+  Graph and rat file generator.  Produces the same hlbrt graphs as
+  fractal.py -X -s SEED followed by gengraph.py -r -s ILFSEED, and the same
+  rat files as Graph.makeRats, but fast enough for graphs with millions of
+  nodes.
+  crun-seq and crun-mpi can also generate their inputs directly, with -G
+  and -L.
+*/
+
+#include <getopt.h>
+
+#include "crun.h"
+
+static void usage(char *name) {
+    outmsg("Usage: %s -g WxH[:REGIONS[:SEED[:EXPANSION]]] [-s ILFSEED] [-o GFILE] [-r MLOAD[:SEED]] [-R RFILE]\n", name);
+    outmsg("   -h        Print this message\n");
+    outmsg("   -g SPEC   Generate W x H graph with REGIONS regions (default %d) from SEED (default %d)\n",
+	   DEFAULT_REGIONS, DEFAULT_GRAPH_SEED);
+    outmsg("             Each region tree cell expands to EXPANSION x EXPANSION nodes (default 5, 8, 4, 2 or 1)\n");
+    outmsg("   -s SEED   Seed for ideal load factors, as gengraph.py -s (default %d)\n", DEFAULT_GRAPH_SEED);
+    outmsg("             The region tree uses the seed in -g, as fractal.py -s\n");
+    outmsg("   -o GFILE  Write graph to GFILE (- for stdout)\n");
+    outmsg("   -r SPEC   Generate LOAD rats per node with distribution M: r(andom), u(niform), d(iagonal), or c(enter)\n");
+    outmsg("             from SEED (default %d)\n", DEFAULTSEED);
+    outmsg("   -R RFILE  Write rats to RFILE (- for stdout)\n");
+    exit(0);
+}
+
+static FILE *open_output(char *fname) {
+    if (strcmp(fname, "-") == 0)
+	return stdout;
+    FILE *f = fopen(fname, "w");
+    if (f == NULL)
+	outmsg("Couldn't open output file %s\n", fname);
+    return f;
+}
+
+int main(int argc, char *argv[]) {
+    char *gspec = NULL;
+    char *rspec = NULL;
+    char *gname = NULL;
+    char *rname = NULL;
+    int width = 0, height = 0;
+    int nregion = DEFAULT_REGIONS;
+    int expansion = 0;
+    random_t gseed = DEFAULT_GRAPH_SEED;
+    random_t ilf_seed = DEFAULT_GRAPH_SEED;
+    rat_mode_t mode = RAT_RANDOM;
+    int load = 0;
+    random_t rseed = DEFAULTSEED;
+    int c;
+    while ((c = getopt(argc, argv, "hg:s:o:r:R:")) != -1) {
+	switch (c) {
+	case 'g':
+	    gspec = optarg;
+	    break;
+	case 's':
+	    ilf_seed = strtoul(optarg, NULL, 0);
+	    break;
+	case 'o':
+	    gname = optarg;
+	    break;
+	case 'r':
+	    rspec = optarg;
+	    break;
+	case 'R':
+	    rname = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (gspec == NULL || (gname == NULL && rname == NULL) || (rname != NULL && rspec == NULL))
+	usage(argv[0]);
+    if (!parse_graph_spec(gspec, &width, &height, &nregion, &gseed, &expansion))
+	exit(1);
+    if (rspec != NULL && !parse_rat_spec(rspec, &mode, &load, &rseed))
+	exit(1);
+
+    double start = currentSeconds();
+    graph_t *g = generate_graph(width, height, nregion, expansion, gseed, 0);
+    if (g == NULL)
+	exit(1);
+    if (gname != NULL) {
+	FILE *gfile = open_output(gname);
+	if (gfile == NULL || !write_graph(gfile, g, ilf_seed)) {
+	    outmsg("Couldn't write graph\n");
+	    exit(1);
+	}
+	if (gfile != stdout)
+	    fclose(gfile);
+    }
+    if (rname != NULL) {
+	int nrat = 0;
+	int *position = generate_rat_positions(g, mode, load, rseed, &nrat);
+	if (position == NULL)
+	    exit(1);
+	FILE *rfile = open_output(rname);
+	if (rfile == NULL || !write_rats(rfile, g->nnode, position, nrat, mode, load, rseed)) {
+	    outmsg("Couldn't write rats\n");
+	    exit(1);
+	}
+	if (rfile != stdout)
+	    fclose(rfile);
+	free(position);
+    }
+    outmsg("Generated in %.3f seconds\n", currentSeconds() - start);
+    return 0;
+}
@@ -30,6 +30,8 @@ graph_t *new_graph(int width, int height, int nedge, int nzone) {
 	ok = ok && g->zone_id != NULL;
 	} else
 	g->zone_id = NULL;
+	g->nregion = 0;
+	g->region_list = NULL;
 	if (!ok) {
 	outmsg("Couldn't allocate graph data structures");
 	return NULL;
@@ -44,6 +46,7 @@ void free_graph(graph_t *g) {
 	free(g->ilf);
 #endif
 	free(g->zone_id);
+	free(g->region_list);
 	free(g);
 }
 
@@ -66,6 +69,53 @@ static inline int find_node(graph_t *g, int x, int y) {
 }
 
 
+/*
+  Attach regions, given by position and size, to graph with complete
+  adjacency lists.  Fills in node and edge counts, and assigns regions
+  and their nodes to nzone zones (when nzone > 0).
+*/
+bool add_regions(graph_t *g, region_t *region_list, int nregion, int nzone) {
+	int i;
+	for (i = 0; i < nregion; i++) {
+	region_t *r = &region_list[i];
+	r->id = i;
+	r->node_count = r->w * r->h;
+	r->zone_id = 0;
+	int edge_count = 0;
+	/* Compute number of edges  */
+	int dx, dy;
+	for (dx = r->x; dx < r->x + r->w; dx++)
+		for (dy = r->y; dy < r->y + r->h; dy++) {
+		int nid = find_node(g, dx, dy);
+		edge_count += g->neighbor_start[nid+1] - g->neighbor_start[nid];
+		}
+	r->edge_count = edge_count;
+	}
+	/* Use partitioning function to assign zones to nodes */
+	if (nzone > 0) {
+	assign_zones(region_list, nregion, nzone);
+	/* Now go back through regions and assign zones to nodes */
+	for (i = 0; i < nregion; i++) {
+		region_t *r = &region_list[i];
+		int zid = r->zone_id;
+		if (zid < 0 || zid > nzone) {
+		outmsg("Invalid zone number %d assigned to region %d.", zid, i);
+		return false;
+		}
+		int dx, dy;
+		for (dx = r->x; dx < r->x + r->w; dx++)
+		for (dy = r->y; dy < r->y + r->h; dy++) {
+			int nid = find_node(g, dx, dy);
+			g->zone_id[nid] = zid;
+		}
+	}
+	}
+	/* Keep regions around for rebalancing */
+	g->nregion = nregion;
+	g->region_list = region_list;
+	return true;
+}
+
 /* Read in graph file and build graph data structure */
 graph_t *read_graph(FILE *infile, int nzone) {
 	char linebuf[MAXLINE];
@@ -166,42 +216,10 @@ graph_t *read_graph(FILE *infile, int nzone) {
 		outmsg("Line #%d of graph file malformed.  Expecting region %d\n", lineno, i+1);
 		return false;
 		}
-		region_list[i].id = i;
 		region_list[i].x = x; region_list[i].y = y; region_list[i].w = w; region_list[i].h = h;
-		region_list[i].node_count = w * h;
-		region_list[i].zone_id = 0;
-		int edge_count = 0;
-		/* Assign region IDs to nodes and compute number of edges  */
-		int dx, dy;
-		for (dx = x; dx < x+w; dx++)
-		for (dy = y; dy < y+h; dy++) {
-			int nid = find_node(g, dx, dy);
-			edge_count += g->neighbor_start[nid+1] - g->neighbor_start[nid];
-		}
-		region_list[i].edge_count = edge_count;
 	}
-	/* Use partitioning function to assign zones to nodes */
-	if (nzone > 0) {
-		assign_zones(region_list, nregion, nzone);
-		/* Now go back through regions and assign zones to nodes */
-		for (i = 0; i < nregion; i++) {
-		int x, y, w, h;
-		x = region_list[i].x; y = region_list[i].y;
-		w = region_list[i].w; h = region_list[i].h;
-		int zid = region_list[i].zone_id;
-		if (zid < 0 || zid > nzone) {
-			outmsg("Invalid zone number %d assigned to region %d.", zid, i);
-			return NULL;
-		}
-		int dx, dy;
-		for (dx = x; dx < x+w; dx++)
-			for (dy = y; dy < y+h; dy++) {
-			int nid = find_node(g, dx, dy);
-			g->zone_id[nid] = zid;
-			}
-		}
-	}
-	free(region_list);
+	if (!add_regions(g, region_list, nregion, nzone))
+		return NULL;
 	outmsg("Loaded graph with %d nodes, %d edges, and %d regions, partitioned into %d zones \n", nnode, nedge, nregion, nzone);
 	} else {
 	outmsg("Loaded graph with %d nodes, %d edges, and %d regions\n", nnode, nedge, nregion);
@@ -236,20 +254,23 @@ void send_graph(graph_t *g) {
 	int nedge = g->nedge;
 	int nzone = g->nzone;
 	int nnode = width * height;
-	int params[4] = {width, height, nedge, nzone};
-	MPI_Bcast(params, 4, MPI_INT, 0, MPI_COMM_WORLD);
+	int params[5] = {width, height, nedge, nzone, g->nregion};
+	MPI_Bcast(params, 5, MPI_INT, 0, MPI_COMM_WORLD);
 	MPI_Bcast(g->neighbor, nedge+nnode, MPI_INT, 0, MPI_COMM_WORLD);
 	MPI_Bcast(g->neighbor_start, nnode+1, MPI_INT, 0, MPI_COMM_WORLD);
 	MPI_Bcast(g->zone_id, nnode, MPI_INT, 0, MPI_COMM_WORLD);
+	if (g->nregion > 0)
+	MPI_Bcast(g->region_list, g->nregion * sizeof(region_t), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
 
 graph_t *get_graph() {
-	int params[4];
-	MPI_Bcast(params, 4, MPI_INT, 0, MPI_COMM_WORLD);
+	int params[5];
+	MPI_Bcast(params, 5, MPI_INT, 0, MPI_COMM_WORLD);
 	int width = params[0];
 	int height = params[1];
 	int nedge = params[2];
 	int nzone = params[3];
+	int nregion = params[4];
 	int nnode = width * height;
 	graph_t *g = new_graph(width, height, nedge, nzone);
 	if (g == NULL)
@@ -257,6 +278,529 @@ graph_t *get_graph() {
 	MPI_Bcast(g->neighbor, nedge+nnode, MPI_INT, 0, MPI_COMM_WORLD);
 	MPI_Bcast(g->neighbor_start, nnode+1, MPI_INT, 0, MPI_COMM_WORLD);
 	MPI_Bcast(g->zone_id, nnode, MPI_INT, 0, MPI_COMM_WORLD);
+	if (nregion > 0) {
+	g->region_list = calloc(nregion, sizeof(region_t));
+	if (g->region_list == NULL) {
+		outmsg("Couldn't allocate space for region list");
+		return NULL;
+	}
+	g->nregion = nregion;
+	MPI_Bcast(g->region_list, nregion * sizeof(region_t), MPI_BYTE, 0, MPI_COMM_WORLD);
+	}
+	return g;
+}
+
+/*
+  Distribute the graph one zone at a time.  Rather than broadcasting the
+  whole graph, process 0 sets up every zone and scatters to each process
+  only the adjacency lists of its own nodes, plus its import and export
+  lists.  Each zone is packed into a single int array:
+
+    L, E                                  Local node and edge (incl. self edge) counts
+    local_node_list[L]
+    degree[L]                             Adjacency list lengths, including self edge
+    neighbor[E]                           Concatenated adjacency lists
+    export_count[Z], import_count[Z]
+    export and import lists for each zone in turn
+
+  Zones that do not hold the whole graph keep node-indexed arrays, but
+  neighbor_start gives empty adjacency lists to nodes outside the zone
+  and zone_id is -1 for nodes that are neither local nor imported.
+*/
+
+/* Number of ints to pack the current zone */
+static int zone_pack_size(graph_t *g) {
+	int size = 2 + 2 * g->local_node_count + g->local_edge_count + 2 * g->nzone;
+	int zid;
+	for (zid = 0; zid < g->nzone; zid++)
+	size += g->export_node_count[zid] + g->import_node_count[zid];
+	return size;
+}
+
+static void pack_zone(graph_t *g, int *pack) {
+	int L = g->local_node_count;
+	int idx, zid, eid;
+	*pack++ = L;
+	*pack++ = g->local_edge_count;
+	memcpy(pack, g->local_node_list, L * sizeof(int));
+	pack += L;
+	for (idx = 0; idx < L; idx++) {
+	int nid = g->local_node_list[idx];
+	*pack++ = g->neighbor_start[nid+1] - g->neighbor_start[nid];
+	}
+	for (idx = 0; idx < L; idx++) {
+	int nid = g->local_node_list[idx];
+	for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++)
+		*pack++ = g->neighbor[eid];
+	}
+	for (zid = 0; zid < g->nzone; zid++) {
+	*pack++ = g->export_node_count[zid];
+	*pack++ = g->import_node_count[zid];
+	}
+	for (zid = 0; zid < g->nzone; zid++) {
+	memcpy(pack, g->export_node_list[zid], g->export_node_count[zid] * sizeof(int));
+	pack += g->export_node_count[zid];
+	memcpy(pack, g->import_node_list[zid], g->import_node_count[zid] * sizeof(int));
+	pack += g->import_node_count[zid];
+	}
+}
+
+/* Build graph holding a single zone */
+static graph_t *unpack_zone(int width, int height, int nedge, int nzone, int this_zone, int *pack) {
+	bool ok = true;
+	int nnode = width * height;
+	int nid, idx, zid;
+	graph_t *g = malloc(sizeof(graph_t));
+	if (g == NULL) {
+	outmsg("Couldn't allocate graph data structures");
+	return NULL;
+	}
+	g->width = width;
+	g->height = height;
+	g->nnode = nnode;
+	g->nedge = nedge;
+	g->nzone = nzone;
+	g->nregion = 0;
+	g->region_list = NULL;
+	g->this_zone = this_zone;
+
+	int L = *pack++;
+	int E = *pack++;
+	int *local_list = pack;
+	pack += L;
+	int *degree = pack;
+	pack += L;
+	g->local_node_count = L;
+	g->local_edge_count = E;
+	g->local_node_list = calloc(L, sizeof(int));
+	ok = ok && g->local_node_list != NULL;
+	g->neighbor = calloc(E, sizeof(int));
+	ok = ok && g->neighbor != NULL;
+	g->neighbor_start = calloc(nnode + 1, sizeof(int));
+	ok = ok && g->neighbor_start != NULL;
+	g->zone_id = calloc(nnode, sizeof(int));
+	ok = ok && g->zone_id != NULL;
+	g->export_node_count = calloc(nzone, sizeof(int));
+	g->export_node_list = calloc(nzone, sizeof(int*));
+	g->import_node_count = calloc(nzone, sizeof(int));
+	g->import_node_list = calloc(nzone, sizeof(int*));
+	ok = ok && g->export_node_count != NULL && g->export_node_list != NULL
+	&& g->import_node_count != NULL && g->import_node_list != NULL;
+	if (!ok) {
+	outmsg("Couldn't allocate graph data structures");
+	return NULL;
+	}
+
+	memcpy(g->local_node_list, local_list, L * sizeof(int));
+	memcpy(g->neighbor, pack, E * sizeof(int));
+	pack += E;
+	/* Local node list is sorted, so can fill in adjacency list starts in one pass */
+	int eid = 0;
+	idx = 0;
+	for (nid = 0; nid < nnode; nid++) {
+	g->neighbor_start[nid] = eid;
+	g->zone_id[nid] = -1;
+	if (idx < L && local_list[idx] == nid) {
+		eid += degree[idx++];
+		g->zone_id[nid] = this_zone;
+	}
+	}
+	g->neighbor_start[nnode] = eid;
+
+	for (zid = 0; zid < nzone; zid++) {
+	g->export_node_count[zid] = *pack++;
+	g->import_node_count[zid] = *pack++;
+	}
+	for (zid = 0; zid < nzone; zid++) {
+	int ecount = g->export_node_count[zid];
+	int icount = g->import_node_count[zid];
+	if (ecount > 0) {
+		g->export_node_list[zid] = calloc(ecount, sizeof(int));
+		if (g->export_node_list[zid] == NULL) {
+		outmsg("Couldn't allocate space for export/import lists");
+		return NULL;
+		}
+		memcpy(g->export_node_list[zid], pack, ecount * sizeof(int));
+	}
+	pack += ecount;
+	if (icount > 0) {
+		g->import_node_list[zid] = calloc(icount, sizeof(int));
+		if (g->import_node_list[zid] == NULL) {
+		outmsg("Couldn't allocate space for export/import lists");
+		return NULL;
+		}
+		memcpy(g->import_node_list[zid], pack, icount * sizeof(int));
+		for (idx = 0; idx < icount; idx++)
+		g->zone_id[pack[idx]] = zid;
+	}
+	pack += icount;
+	}
+	return g;
+}
+
+/*
+  Called by process 0.  Leaves process 0 with the whole graph, set up as zone 0.
+  Each zone is set up once and packed into a buffer that grows as needed,
+  and its lists are freed before moving on to the next zone.
+*/
+bool send_zone_graphs(graph_t *g) {
+	int nzone = g->nzone;
+	int params[4] = {g->width, g->height, g->nedge, nzone};
+	int pack_size[nzone];
+	int pack_offset[nzone];
+	int total = 0;
+	int capacity = 1024;
+	int zid;
+	MPI_Bcast(params, 4, MPI_INT, 0, MPI_COMM_WORLD);
+	int *pack = calloc(capacity, sizeof(int));
+	if (pack == NULL) {
+	outmsg("Couldn't allocate space to distribute zones");
+	return false;
+	}
+	pack_size[0] = 0;
+	pack_offset[0] = 0;
+	for (zid = 1; zid < nzone; zid++) {
+	if (!setup_zone(g, zid, false)) {
+		free(pack);
+		return false;
+	}
+	pack_size[zid] = zone_pack_size(g);
+	pack_offset[zid] = total;
+	if (total + pack_size[zid] > capacity) {
+		while (total + pack_size[zid] > capacity)
+		capacity *= 2;
+		int *npack = realloc(pack, capacity * sizeof(int));
+		if (npack == NULL) {
+		outmsg("Couldn't allocate space to distribute zones");
+		free(pack);
+		return false;
+		}
+		pack = npack;
+	}
+	pack_zone(g, pack + total);
+	total += pack_size[zid];
+	clear_zone(g);
+	}
+	MPI_Scatter(pack_size, 1, MPI_INT, MPI_IN_PLACE, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	MPI_Scatterv(pack, pack_size, pack_offset, MPI_INT, MPI_IN_PLACE, 0, MPI_INT, 0, MPI_COMM_WORLD);
+	free(pack);
+	return setup_zone(g, 0, false);
+}
+
+/* Called by other processes to get their zones from process 0 */
+graph_t *get_zone_graph() {
+	int params[4];
+	int this_zone;
+	int size;
+	MPI_Comm_rank(MPI_COMM_WORLD, &this_zone);
+	MPI_Bcast(params, 4, MPI_INT, 0, MPI_COMM_WORLD);
+	MPI_Scatter(NULL, 1, MPI_INT, &size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	int *pack = calloc(size, sizeof(int));
+	if (pack == NULL) {
+	outmsg("Couldn't allocate space to receive zone");
+	return NULL;
+	}
+	MPI_Scatterv(NULL, NULL, NULL, MPI_INT, pack, size, MPI_INT, 0, MPI_COMM_WORLD);
+	graph_t *g = unpack_zone(params[0], params[1], params[2], params[3], this_zone, pack);
+	free(pack);
+	return g;
+}
+
+/*
+  Load graph file in parallel.  Every process parses the lines in its
+  chunk of the file.  Line types are identified by their first character,
+  and chunks are in file order, so edges remain sorted by head.  Regions
+  are shared by all processes, and process 0 partitions them.  Each
+  edge is then sent to the process owning its head, or to all processes
+  when whole is set.  Nodes outside the zone have empty adjacency lists,
+  but zone ids are filled in for all nodes.
+*/
+graph_t *load_graph(char *fname, int nzone, bool whole) {
+	int this_zone;
+	int header[4] = {-1, -1, -1, 0};
+	int nline = 0;
+	int lineno = 0;
+	int cap = 1024;
+	int nlocal_edge = 0;
+	int nlocal_node = 0;
+	int nlocal_region = 0;
+	int i, zid;
+	char *line, *pos;
+	MPI_Comm_rank(MPI_COMM_WORLD, &this_zone);
+
+	char *text = read_chunk(fname);
+	if (!all_ok(text != NULL)) {
+	free(text);
+	return NULL;
+	}
+	for (pos = text; *pos; pos++)
+	if (*pos == '\n')
+		nline++;
+	MPI_Exscan(&nline, &lineno, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+	if (this_zone == 0)
+	lineno = 0;
+
+	bool ok = true;
+	int *edges = calloc(2 * cap, sizeof(int));
+	int *regions = calloc(4 * cap, sizeof(int));
+	int region_cap = cap;
+	int *edge_line = calloc(cap, sizeof(int));
+	if (edges == NULL || regions == NULL || edge_line == NULL) {
+	outmsg("Couldn't allocate space to load graph");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	pos = text;
+	while (ok && (line = chunk_line(&pos)) != NULL) {
+	lineno++;
+	if (is_comment(line))
+		continue;
+	char *c = line;
+	while (isspace(*c))
+		c++;
+	if (isdigit(*c)) {
+		if (sscanf(line, "%d %d %d %d", &header[0], &header[1], &header[2], &header[3]) < 3) {
+		outmsg("ERROR. Malformed graph file header (line %d)\n", lineno);
+		ok = false;
+		}
+	} else if (*c == 'n') {
+		nlocal_node++;
+	} else if (*c == 'e') {
+		if (nlocal_edge == cap) {
+		cap *= 2;
+		edges = realloc(edges, 2 * cap * sizeof(int));
+		edge_line = realloc(edge_line, cap * sizeof(int));
+		if (edges == NULL || edge_line == NULL) {
+			outmsg("Couldn't allocate space to load graph");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		}
+		if (sscanf(line, "e %d %d", &edges[2*nlocal_edge], &edges[2*nlocal_edge+1]) != 2) {
+		outmsg("Line #%d of graph file malformed.  Expecting edge\n", lineno);
+		ok = false;
+		}
+		edge_line[nlocal_edge++] = lineno;
+	} else if (*c == 'r') {
+		if (nlocal_region == region_cap) {
+		region_cap *= 2;
+		regions = realloc(regions, 4 * region_cap * sizeof(int));
+		if (regions == NULL) {
+			outmsg("Couldn't allocate space to load graph");
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		}
+		int *r = &regions[4*nlocal_region++];
+		if (sscanf(line, "r %d %d %d %d", &r[0], &r[1], &r[2], &r[3]) != 4) {
+		outmsg("Line #%d of graph file malformed.  Expecting region\n", lineno);
+		ok = false;
+		}
+	} else {
+		outmsg("Line #%d of graph file malformed\n", lineno);
+		ok = false;
+	}
+	}
+	free(text);
+
+	/* Agree on header and line counts */
+	MPI_Allreduce(MPI_IN_PLACE, header, 4, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+	int width = header[0];
+	int height = header[1];
+	int nedge = header[2];
+	int nregion = header[3];
+	int nnode = width * height;
+	int counts[3] = {nlocal_node, nlocal_edge, nlocal_region};
+	MPI_Allreduce(MPI_IN_PLACE, counts, 3, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+	ok = all_ok(ok);
+	if (ok && width < 0) {
+	if (this_zone == 0)
+		outmsg("ERROR. Malformed graph file header (line 1)\n");
+	ok = false;
+	} else if (ok && (counts[0] != nnode || counts[1] != nedge || counts[2] != nregion)) {
+	if (this_zone == 0)
+		outmsg("Graph file has %d nodes, %d edges, and %d regions.  Expecting %d, %d, and %d\n",
+		   counts[0], counts[1], counts[2], nnode, nedge, nregion);
+	ok = false;
+	}
+
+	/* Check edges, including ordering across chunks */
+	int last_head = -1;
+	int prev_head = -1;
+	for (i = 0; ok && i < nlocal_edge; i++) {
+	int hid = edges[2*i];
+	int tid = edges[2*i+1];
+	if (hid < 0 || hid >= nnode) {
+		outmsg("Invalid head index %d on line %d\n", hid, edge_line[i]);
+		ok = false;
+	} else if (tid < 0 || tid >= nnode) {
+		outmsg("Invalid tail index %d on line %d\n", tid, edge_line[i]);
+		ok = false;
+	}
+	}
+	if (nlocal_edge > 0)
+	last_head = edges[2*(nlocal_edge-1)];
+	MPI_Exscan(&last_head, &prev_head, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+	if (this_zone == 0)
+	prev_head = -1;
+	for (i = 0; ok && i < nlocal_edge; i++) {
+	if (edges[2*i] < prev_head) {
+		outmsg("Head index %d on line %d out of order\n", edges[2*i], edge_line[i]);
+		ok = false;
+	}
+	prev_head = edges[2*i];
+	}
+	free(edge_line);
+	if (!all_ok(ok)) {
+	free(edges);
+	free(regions);
+	return NULL;
+	}
+
+	graph_t *g = new_graph(width, height, whole ? nedge : 0, nzone);
+	int *degree = calloc(nnode, sizeof(int));
+	if (g == NULL || degree == NULL) {
+	outmsg("Couldn't allocate graph data structures");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	g->nedge = nedge;
+	g->local_edge_count = nedge;
+
+	/* All processes get all regions, with edge counts from global node degrees */
+	if (nregion > 0) {
+	int region_count[nzone], region_offset[nzone];
+	int rcount = 4 * nlocal_region;
+	MPI_Allgather(&rcount, 1, MPI_INT, region_count, 1, MPI_INT, MPI_COMM_WORLD);
+	int total = 0;
+	for (zid = 0; zid < nzone; zid++) {
+		region_offset[zid] = total;
+		total += region_count[zid];
+	}
+	int *all_regions = calloc(total, sizeof(int));
+	g->region_list = calloc(nregion, sizeof(region_t));
+	if (all_regions == NULL || g->region_list == NULL) {
+		outmsg("Couldn't allocate space for region list");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	g->nregion = nregion;
+	MPI_Allgatherv(regions, rcount, MPI_INT, all_regions, region_count, region_offset, MPI_INT, MPI_COMM_WORLD);
+	for (i = 0; i < nlocal_edge; i++)
+		degree[edges[2*i]]++;
+	MPI_Allreduce(MPI_IN_PLACE, degree, nnode, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+	int zones[nregion];
+	for (i = 0; i < nregion; i++) {
+		region_t *r = &g->region_list[i];
+		r->id = i;
+		r->x = all_regions[4*i]; r->y = all_regions[4*i+1];
+		r->w = all_regions[4*i+2]; r->h = all_regions[4*i+3];
+		r->node_count = r->w * r->h;
+		r->zone_id = 0;
+		int edge_count = 0;
+		int dx, dy;
+		for (dx = r->x; dx < r->x + r->w; dx++)
+		for (dy = r->y; dy < r->y + r->h; dy++)
+			edge_count += degree[find_node(g, dx, dy)] + 1;
+		r->edge_count = edge_count;
+	}
+	free(all_regions);
+	/* Partition on one process, so that every process agrees */
+	if (this_zone == 0) {
+		assign_zones(g->region_list, nregion, nzone);
+		for (i = 0; i < nregion; i++)
+		zones[i] = g->region_list[i].zone_id;
+	}
+	MPI_Bcast(zones, nregion, MPI_INT, 0, MPI_COMM_WORLD);
+	for (i = 0; i < nregion; i++) {
+		region_t *r = &g->region_list[i];
+		r->zone_id = zones[i];
+		if (zones[i] < 0 || zones[i] >= nzone) {
+		if (this_zone == 0)
+			outmsg("Invalid zone number %d assigned to region %d.", zones[i], i);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		int dx, dy;
+		for (dx = r->x; dx < r->x + r->w; dx++)
+		for (dy = r->y; dy < r->y + r->h; dy++)
+			g->zone_id[find_node(g, dx, dy)] = zones[i];
+	}
+	}
+	free(regions);
+	free(degree);
+
+	/* Send edges to the owners of their heads.  Receiving in process order keeps them sorted */
+	int send_count[nzone], send_offset[nzone];
+	int recv_count[nzone], recv_offset[nzone];
+	memset(send_count, 0, nzone * sizeof(int));
+	for (i = 0; i < nlocal_edge; i++)
+	send_count[g->zone_id[edges[2*i]]] += 2;
+	int send_total = 2 * nlocal_edge;
+	int recv_total = 0;
+	int *send_buf = edges;
+	if (whole) {
+	MPI_Allgather(&send_total, 1, MPI_INT, recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+	} else {
+	MPI_Alltoall(send_count, 1, MPI_INT, recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+	send_buf = calloc(send_total + 1, sizeof(int));
+	if (send_buf == NULL) {
+		outmsg("Couldn't allocate space to load graph");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	}
+	send_total = 0;
+	for (zid = 0; zid < nzone; zid++) {
+	send_offset[zid] = send_total;
+	send_total += send_count[zid];
+	recv_offset[zid] = recv_total;
+	recv_total += recv_count[zid];
+	}
+	int *recv_buf = calloc(recv_total + 1, sizeof(int));
+	if (recv_buf == NULL) {
+	outmsg("Couldn't allocate space to load graph");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	if (whole) {
+	MPI_Allgatherv(edges, 2 * nlocal_edge, MPI_INT, recv_buf, recv_count, recv_offset, MPI_INT, MPI_COMM_WORLD);
+	} else {
+	int fill[nzone];
+	memcpy(fill, send_offset, nzone * sizeof(int));
+	for (i = 0; i < nlocal_edge; i++) {
+		zid = g->zone_id[edges[2*i]];
+		send_buf[fill[zid]++] = edges[2*i];
+		send_buf[fill[zid]++] = edges[2*i+1];
+	}
+	MPI_Alltoallv(send_buf, send_count, send_offset, MPI_INT,
+		      recv_buf, recv_count, recv_offset, MPI_INT, MPI_COMM_WORLD);
+	free(send_buf);
+	}
+	free(edges);
+
+	/* Build adjacency lists, with self edges, for the nodes we hold */
+	int nid, eid = 0;
+	int nheld = 0;
+	for (nid = 0; nid < nnode; nid++)
+	if (whole || g->zone_id[nid] == this_zone)
+		nheld++;
+	if (!whole) {
+	free(g->neighbor);
+	g->neighbor = calloc(nheld + recv_total / 2, sizeof(int));
+	if (g->neighbor == NULL) {
+		outmsg("Couldn't allocate graph data structures");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	}
+	i = 0;
+	for (nid = 0; nid < nnode; nid++) {
+	g->neighbor_start[nid] = eid;
+	if (!whole && g->zone_id[nid] != this_zone)
+		continue;
+	g->neighbor[eid++] = nid;
+	while (i < recv_total && recv_buf[i] == nid) {
+		g->neighbor[eid++] = recv_buf[i+1];
+		i += 2;
+	}
+	}
+	g->neighbor_start[nnode] = eid;
+	free(recv_buf);
+
+	if (this_zone == 0)
+	outmsg("Loaded graph with %d nodes, %d edges, and %d regions, partitioned into %d zones \n", nnode, nedge, nregion, nzone);
 	return g;
 }
 #endif
@@ -287,12 +831,17 @@ static void format_list(int *list, int count, char *buf) {
 
 // Used to clear out information from one zone before setting up another
 void clear_zone(graph_t *g) {
+	int zid;
 	g->local_node_count = 0;
 	g->local_edge_count = 0;
 	free(g->local_node_list); g->local_node_list = NULL;
-	g->export_node_count = 0;
+	for (zid = 0; zid < g->nzone; zid++) {
+	free(g->export_node_list[zid]);
+	free(g->import_node_list[zid]);
+	}
+	free(g->export_node_count); g->export_node_count = NULL;
 	free(g->export_node_list); g->export_node_list = NULL;
-	g->import_node_count = 0;
+	free(g->import_node_count); g->import_node_count = NULL;
 	free(g->import_node_list); g->import_node_list = NULL;    
 }
 
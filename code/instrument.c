@@ -1,5 +1,16 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #if MPI
 #include <math.h>
@@ -10,7 +21,7 @@
 #include "instrument.h"
 
 /* Instrument different sections of program */
-static char *activity_name[ACTIVITY_COUNT] = { "unknown", "startup", "compute_weights", "compute_sums", "find_moves", "local_comm", "global_comm"};
+static char *activity_name[ACTIVITY_COUNT] = { "unknown", "startup", "compute_weights", "compute_sums", "find_moves", "local_comm", "comm_pack", "comm_wait", "comm_unpack", "global_comm", "rebalance", "output"};
 
 #if MPI
 #define DATA_COUNT (ACTIVITY_COUNT+2)
@@ -20,16 +31,192 @@ static char *activity_name[ACTIVITY_COUNT] = { "unknown", "startup", "compute_we
 static bool initialized = false;
 
 static bool tracking = false;
-static double global_start_time = 0.0;
+static uint64_t global_start_time = 0;
+/* Conversion from ticks, set on initialization */
+static double tick_seconds = 1e-9;
+static double tick_ns = 1.0;
 
 #define MAXDEPTH 20
 
-static activity_t activity_stack[MAXDEPTH];
-static int stack_level = 0;
+/*
+  Histograms of durations, in ns.  Each power of two is split into 4
+  buckets, so that percentiles are within 25%.  One histogram per
+  activity, plus batches and steps
+*/
+#define HIST_SUB 4
+#define HIST_BUCKETS (HIST_SUB*42)
+#define HIST_BATCH ACTIVITY_COUNT
+#define HIST_STEP (ACTIVITY_COUNT+1)
+#define HIST_COUNT (ACTIVITY_COUNT+2)
+
 
-static double current_start_time = 0.0;
+/*
+  Each thread keeps its own activity stack, times, and histograms, with
+  times in clock ticks.  They are merged when reporting.  Steps,
+  batches, counters, and the timeline belong to the main thread, i.e.,
+  the one that first records an activity.
+*/
+typedef struct {
+    activity_t activity_stack[MAXDEPTH];
+    /* Start time of each activity on the stack */
+    uint64_t start_stack[MAXDEPTH];
+    int stack_level;
+    uint64_t current_start_time;
+    uint64_t accum[ACTIVITY_COUNT];
+    long long hist[HIST_COUNT][HIST_BUCKETS];
+    uint64_t hist_max[HIST_COUNT];
+} context_t;
 
+#define MAXCONTEXT 64
+
+static __thread context_t *my_context = NULL;
+static context_t *context_list[MAXCONTEXT];
+static int context_count = 0;
+static context_t *main_context = NULL;
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Totals over all threads, in seconds.  Filled in by merge_contexts */
 static double accum[ACTIVITY_COUNT];
+static long long hist[HIST_COUNT][HIST_BUCKETS];
+static double hist_max[HIST_COUNT];
+
+static char *hist_name(int i) {
+    if (i < ACTIVITY_COUNT)
+	return activity_name[i];
+    return i == HIST_BATCH ? "batch" : "step";
+}
+
+static uint64_t last_batch_time = 0;
+static uint64_t step_start_time = 0;
+
+/* Per-step breakdown */
+static bool steps_enabled = false;
+static uint64_t last_accum[ACTIVITY_COUNT];
+/* Each entry holds ACTIVITY_COUNT times followed by max node count */
+#define STEP_DATA (ACTIVITY_COUNT+1)
+static double *step_data = NULL;
+static int step_count = 0;
+static int step_alloc = 0;
+
+/* Hardware counters.  Deltas attributed to activity on top of stack */
+typedef enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_LLC_MISSES, COUNTER_BRANCH_MISSES, COUNTER_COUNT } counter_t;
+
+static char *counter_name[COUNTER_COUNT] = { "cycles", "instructions", "LLC misses", "branch misses" };
+
+static bool counting = false;
+/* File descriptor for each counter.  -1 if not available */
+static int counter_fd[COUNTER_COUNT] = { -1, -1, -1, -1 };
+/* Position of each counter in group read.  -1 if not available */
+static int counter_slot[COUNTER_COUNT];
+static int counter_nslot = 0;
+static long long counter_last[COUNTER_COUNT];
+static long long counter_accum[ACTIVITY_COUNT][COUNTER_COUNT];
+
+#ifdef __linux__
+static int open_counter(uint32_t type, uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group_fd < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+void track_counters(bool enable) {
+    int c;
+    if (!enable || counting)
+	return;
+#ifdef __linux__
+    uint32_t type[COUNTER_COUNT] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+    uint64_t config[COUNTER_COUNT] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+				       PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    /* Cycle counter leads group, so that all are read with one system call */
+    counter_fd[COUNTER_CYCLES] = open_counter(type[COUNTER_CYCLES], config[COUNTER_CYCLES], -1);
+    if (counter_fd[COUNTER_CYCLES] < 0) {
+	fprintf(stderr, "Couldn't open hardware counters (%s).  Not counting\n", strerror(errno));
+	return;
+    }
+    counter_slot[COUNTER_CYCLES] = counter_nslot++;
+    for (c = 1; c < COUNTER_COUNT; c++) {
+	counter_fd[c] = open_counter(type[c], config[c], counter_fd[COUNTER_CYCLES]);
+	if (counter_fd[c] < 0) {
+	    fprintf(stderr, "Couldn't open counter for %s (%s).  Not counting\n", counter_name[c], strerror(errno));
+	    counter_slot[c] = -1;
+	} else
+	    counter_slot[c] = counter_nslot++;
+    }
+    ioctl(counter_fd[COUNTER_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counter_fd[COUNTER_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    counting = true;
+#else
+    fprintf(stderr, "Hardware counters only available on Linux.  Not counting\n");
+#endif
+}
+
+/* Read counters and attribute changes to activity a */
+static inline void update_counters(int a) {
+#ifdef __linux__
+    uint64_t buf[1+COUNTER_COUNT];
+    int c;
+    if (read(counter_fd[COUNTER_CYCLES], buf, (1+counter_nslot) * sizeof(uint64_t)) <= 0)
+	return;
+    for (c = 0; c < COUNTER_COUNT; c++) {
+	if (counter_slot[c] < 0)
+	    continue;
+	long long val = (long long) buf[1+counter_slot[c]];
+	counter_accum[a][c] += val - counter_last[c];
+	counter_last[c] = val;
+    }
+#endif
+}
+
+/* Timeline events.  Names are activities, then the following */
+#define EVENT_BATCH HIST_BATCH
+#define EVENT_STEP HIST_STEP
+#define EVENT_SEND (HIST_COUNT)
+#define EVENT_RECV (HIST_COUNT+1)
+/* Stop recording beyond this many events */
+#define EVENT_MAX (1 << 24)
+
+typedef struct {
+    uint64_t start;
+    uint64_t finish;
+    int name;
+    int peer;
+    int bytes;
+} event_t;
+
+static char *timeline_name = NULL;
+static bool recording = false;
+static uint64_t timeline_origin = 0;
+static event_t *event_list = NULL;
+static int event_count = 0;
+static int event_alloc = 0;
+
+static inline void add_event(int name, uint64_t start, uint64_t finish, int peer, int bytes) {
+    if (event_count == event_alloc) {
+	int nalloc = event_alloc == 0 ? 4096 : 2 * event_alloc;
+	event_t *nlist = nalloc > EVENT_MAX ? NULL : realloc(event_list, nalloc * sizeof(event_t));
+	if (nlist == NULL) {
+	    fprintf(stderr, "Timeline has %d events.  Not recording any more\n", event_count);
+	    recording = false;
+	    return;
+	}
+	event_list = nlist;
+	event_alloc = nalloc;
+    }
+    event_t *e = &event_list[event_count++];
+    e->start = start;
+    e->finish = finish;
+    e->name = name;
+    e->peer = peer;
+    e->bytes = bytes;
+}
 
 void track_activity(bool enable) {
     tracking = enable;
@@ -41,51 +228,534 @@ static void init_instrument() {
     if (initialized)
 	return;
     initialized = true;
-    global_start_time = currentSeconds();
-    int a;
-    for (a = 0; a < ACTIVITY_COUNT; a++) {
-	accum[a] = 0.0;
+    tick_seconds = secondsPerTick();
+    tick_ns = tick_seconds * 1e9;
+    global_start_time = currentTicks();
+    memset(last_accum, 0, sizeof(last_accum));
+    memset(counter_accum, 0, sizeof(counter_accum));
+    memset(counter_last, 0, sizeof(counter_last));
+    if (counting)
+	update_counters(ACTIVITY_NONE);
+    last_batch_time = global_start_time;
+    step_start_time = global_start_time;
+}
+
+/* Context for calling thread.  Created on first use.  NULL if too many threads */
+static context_t *get_context() {
+    context_t *ctx = my_context;
+    if (ctx != NULL)
+	return ctx;
+    init_instrument();
+    ctx = calloc(1, sizeof(context_t));
+    if (ctx == NULL)
+	return NULL;
+    ctx->stack_level = 0;
+    ctx->activity_stack[0] = ACTIVITY_NONE;
+    ctx->start_stack[0] = ctx->current_start_time = currentTicks();
+    pthread_mutex_lock(&context_lock);
+    if (context_count == MAXCONTEXT) {
+	pthread_mutex_unlock(&context_lock);
+	fprintf(stderr, "Too many threads for instrumentation.  Not tracking this one\n");
+	free(ctx);
+	return NULL;
+    }
+    context_list[context_count++] = ctx;
+    if (main_context == NULL)
+	main_context = ctx;
+    pthread_mutex_unlock(&context_lock);
+    my_context = ctx;
+    return ctx;
+}
+
+static inline void record_duration(context_t *ctx, int h, uint64_t ticks) {
+    uint64_t ns = (uint64_t) (ticks * tick_ns);
+    int b = (int) ns;
+    if (ns >= HIST_SUB) {
+	/* Exponent and next 2 bits */
+	int e = 63 - __builtin_clzll(ns);
+	b = HIST_SUB * (e-1) + (int) ((ns >> (e-2)) & (HIST_SUB-1));
     }
-    stack_level = 0;
-    activity_stack[stack_level] = ACTIVITY_NONE;
+    if (b >= HIST_BUCKETS)
+	b = HIST_BUCKETS-1;
+    ctx->hist[h][b]++;
+    if (ticks > ctx->hist_max[h])
+	ctx->hist_max[h] = ticks;
 }
 
 void start_activity(activity_t a) {
     if (!tracking)
 	return;
-    init_instrument();
-    int olda = activity_stack[stack_level];
-    double new_time = currentSeconds();
-    accum[olda] += new_time - current_start_time;
-    current_start_time = new_time;
-    activity_stack[++stack_level] = a;
-    if (stack_level >= MAXDEPTH) {
+    context_t *ctx = get_context();
+    if (ctx == NULL)
+	return;
+    int olda = ctx->activity_stack[ctx->stack_level];
+    uint64_t new_time = currentTicks();
+    ctx->accum[olda] += new_time - ctx->current_start_time;
+    ctx->current_start_time = new_time;
+    if (counting && ctx == main_context)
+	update_counters(olda);
+    if (ctx->stack_level+1 >= MAXDEPTH) {
 	fprintf(stderr, "Runaway instrumentation activity stack.  Disabling\n");
 	tracking = false;
 	return;
     }
+    ctx->activity_stack[++ctx->stack_level] = a;
+    ctx->start_stack[ctx->stack_level] = new_time;
 }
 
 void finish_activity(activity_t a) {
     if (!tracking)
 	return;
-    init_instrument();
-    int olda = activity_stack[stack_level];
+    context_t *ctx = get_context();
+    if (ctx == NULL)
+	return;
+    int olda = ctx->activity_stack[ctx->stack_level];
     if (a != olda) {
 	fprintf(stderr, "Warning.  Started activity %s, but now finishing activity %s.  Disabling\n",
 		activity_name[olda], activity_name[a]);
 	tracking = false;
 	return;
     }
-    double new_time = currentSeconds();
-    accum[olda] += (new_time - current_start_time);
-    current_start_time = new_time;
-    stack_level--;
-    if (stack_level < 0) {
+    if (ctx->stack_level == 0) {
 	fprintf(stderr, "Warning, popped off bottom of instrumentation activity stack.  Disabling\n");
 	tracking = false;
 	return;
     }
+    uint64_t new_time = currentTicks();
+    uint64_t start_time = ctx->start_stack[ctx->stack_level];
+    ctx->accum[olda] += (new_time - ctx->current_start_time);
+    ctx->current_start_time = new_time;
+    record_duration(ctx, olda, new_time - start_time);
+    if (ctx == main_context) {
+	if (counting)
+	    update_counters(olda);
+	if (recording)
+	    add_event(olda, start_time, new_time, -1, 0);
+    }
+    ctx->stack_level--;
+}
+
+double activity_time(activity_t a) {
+    if (!tracking)
+	return 0.0;
+    context_t *ctx = get_context();
+    if (ctx == NULL)
+	return 0.0;
+    return ctx->accum[a] * tick_seconds;
+}
+
+void track_steps(bool enable) {
+    steps_enabled = enable;
+}
+
+bool tracking_steps() {
+    return tracking && steps_enabled;
+}
+
+/* Record duration of batch ending now.  Main thread only */
+void mark_batch() {
+    if (!tracking)
+	return;
+    context_t *ctx = get_context();
+    if (ctx != main_context)
+	return;
+    uint64_t new_time = currentTicks();
+    record_duration(ctx, HIST_BATCH, new_time - last_batch_time);
+    if (recording)
+	add_event(EVENT_BATCH, last_batch_time, new_time, -1, 0);
+    last_batch_time = new_time;
+}
+
+/*
+  Mark end of step.  Step 0 is the initial state, and so only resets
+  the timers.  max_count only used when tracking steps.  Main thread only
+*/
+void mark_step(int step, int max_count) {
+    if (!tracking)
+	return;
+    context_t *ctx = get_context();
+    if (ctx != main_context)
+	return;
+    int a;
+    int olda = ctx->activity_stack[ctx->stack_level];
+    uint64_t new_time = currentTicks();
+    ctx->accum[olda] += new_time - ctx->current_start_time;
+    ctx->current_start_time = new_time;
+    last_batch_time = new_time;
+    if (step > 0) {
+	record_duration(ctx, HIST_STEP, new_time - step_start_time);
+	if (recording)
+	    add_event(EVENT_STEP, step_start_time, new_time, -1, step);
+    }
+    step_start_time = new_time;
+    if (!steps_enabled)
+	return;
+    if (step > 0) {
+	if (step_count == step_alloc) {
+	    int nalloc = step_alloc == 0 ? 64 : 2 * step_alloc;
+	    double *ndata = realloc(step_data, nalloc * STEP_DATA * sizeof(double));
+	    if (ndata == NULL) {
+		fprintf(stderr, "Couldn't allocate space for step data.  Disabling step tracking\n");
+		steps_enabled = false;
+		return;
+	    }
+	    step_data = ndata;
+	    step_alloc = nalloc;
+	}
+	double *data = &step_data[step_count * STEP_DATA];
+	for (a = 0; a < ACTIVITY_COUNT; a++)
+	    data[a] = (ctx->accum[a] - last_accum[a]) * tick_seconds;
+	data[ACTIVITY_COUNT] = (double) max_count;
+	step_count++;
+    }
+    for (a = 0; a < ACTIVITY_COUNT; a++)
+	last_accum[a] = ctx->accum[a];
+}
+
+/*
+  Sum times and histograms of all threads.  Time other threads spend
+  outside of any activity is idle, and so is left out.
+*/
+static void merge_contexts() {
+    int i, a, h, b;
+    memset(accum, 0, sizeof(accum));
+    memset(hist, 0, sizeof(hist));
+    memset(hist_max, 0, sizeof(hist_max));
+    pthread_mutex_lock(&context_lock);
+    for (i = 0; i < context_count; i++) {
+	context_t *ctx = context_list[i];
+	for (a = ctx == main_context ? 0 : 1; a < ACTIVITY_COUNT; a++)
+	    accum[a] += ctx->accum[a] * tick_seconds;
+	for (h = 0; h < HIST_COUNT; h++) {
+	    for (b = 0; b < HIST_BUCKETS; b++)
+		hist[h][b] += ctx->hist[h][b];
+	    if (ctx->hist_max[h] * tick_seconds > hist_max[h])
+		hist_max[h] = ctx->hist_max[h] * tick_seconds;
+	}
+    }
+    pthread_mutex_unlock(&context_lock);
+}
+
+void track_timeline(char *fname) {
+    timeline_name = fname;
+    recording = true;
+#if MPI
+    /* Line up clocks of processes, to within barrier latency */
+    MPI_Barrier(MPI_COMM_WORLD);
+#endif
+    timeline_origin = currentTicks();
+}
+
+/* Communication between zones.  Row of matrix for this zone, indexed by destination */
+typedef enum { COMM_MESSAGES, COMM_BYTES, COMM_RATS, COMM_COUNT } comm_t;
+
+static bool comm_tracking = false;
+static char *comm_file = NULL;
+static long long *comm_row = NULL;
+static int comm_nzone = 0;
+
+void track_comm(char *fname) {
+    comm_tracking = true;
+    comm_file = fname;
+#if MPI
+    MPI_Comm_size(MPI_COMM_WORLD, &comm_nzone);
+#else
+    comm_nzone = 1;
+#endif
+    comm_row = calloc(comm_nzone * COMM_COUNT, sizeof(long long));
+    if (comm_row == NULL) {
+	fprintf(stderr, "Couldn't allocate space for communication matrix.  Not tracking\n");
+	comm_tracking = false;
+    }
+}
+
+void record_message(bool send, int peer, int bytes) {
+    if (!tracking)
+	return;
+    if (send && comm_tracking) {
+	comm_row[peer * COMM_COUNT + COMM_MESSAGES]++;
+	comm_row[peer * COMM_COUNT + COMM_BYTES] += bytes;
+    }
+    if (recording && get_context() == main_context) {
+	uint64_t now = currentTicks();
+	add_event(send ? EVENT_SEND : EVENT_RECV, now, now, peer, bytes);
+    }
+}
+
+void record_rats(int peer, int nrat) {
+    if (tracking && comm_tracking)
+	comm_row[peer * COMM_COUNT + COMM_RATS] += nrat;
+}
+
+#if MPI
+static char *comm_name[COMM_COUNT] = { "messages", "bytes", "rats" };
+
+/* Gather matrix on process 0, then print it and write CSV file */
+static void show_comm(FILE *f, int this_zone) {
+    int nzone = comm_nzone;
+    int src, dst, c;
+    int rowlen = nzone * COMM_COUNT;
+    long long *matrix = NULL;
+    if (this_zone == 0) {
+	matrix = calloc(nzone * rowlen, sizeof(long long));
+	if (matrix == NULL)
+	    fprintf(stderr, "Couldn't allocate space for communication matrix\n");
+    }
+    MPI_Gather(comm_row, rowlen, MPI_LONG_LONG, matrix, rowlen, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    if (matrix == NULL)
+	return;
+    for (c = 0; c < COMM_COUNT; c++) {
+	fprintf(f, "Sent %-8s", comm_name[c]);
+	for (dst = 0; dst < nzone; dst++)
+	    fprintf(f, "%10d", dst);
+	fprintf(f, "     Total\n");
+	for (src = 0; src < nzone; src++) {
+	    long long total = 0;
+	    fprintf(f, "%13d", src);
+	    for (dst = 0; dst < nzone; dst++) {
+		long long val = matrix[src * rowlen + dst * COMM_COUNT + c];
+		total += val;
+		fprintf(f, "%10lld", val);
+	    }
+	    fprintf(f, "%10lld\n", total);
+	}
+    }
+    if (comm_file != NULL) {
+	FILE *cf = fopen(comm_file, "w");
+	if (cf == NULL)
+	    fprintf(stderr, "Couldn't open communication file %s\n", comm_file);
+	else {
+	    fprintf(cf, "src,dst,messages,bytes,rats\n");
+	    for (src = 0; src < nzone; src++)
+		for (dst = 0; dst < nzone; dst++) {
+		    long long *val = &matrix[src * rowlen + dst * COMM_COUNT];
+		    if (val[COMM_MESSAGES] > 0)
+			fprintf(cf, "%d,%d,%lld,%lld,%lld\n", src, dst,
+				val[COMM_MESSAGES], val[COMM_BYTES], val[COMM_RATS]);
+		}
+	    fclose(cf);
+	}
+    }
+    free(matrix);
+}
+#endif
+
+/* Format events of process as JSON objects.  Returns malloc'ed string */
+static char *format_events(int pid, size_t *lenp) {
+    /* Longest event is under 160 characters */
+    size_t alloc = 256 + (size_t) event_count * 160;
+    char *buf = malloc(alloc);
+    if (buf == NULL) {
+	*lenp = 0;
+	return NULL;
+    }
+    size_t len = 0;
+    int i;
+    len += sprintf(buf+len, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"zone %d\"}},\n", pid, pid);
+    len += sprintf(buf+len, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":1,\"args\":{\"name\":\"steps\"}},\n", pid);
+    for (i = 0; i < event_count; i++) {
+	event_t *e = &event_list[i];
+	double ts = (double) (int64_t) (e->start - timeline_origin) * tick_seconds * 1e6;
+	double dur = (double) (e->finish - e->start) * tick_seconds * 1e6;
+	if (e->name == EVENT_SEND || e->name == EVENT_RECV)
+	    len += sprintf(buf+len, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":0,\"args\":{\"peer\":%d,\"bytes\":%d}},\n",
+			   e->name == EVENT_SEND ? "send" : "recv", ts, pid, e->peer, e->bytes);
+	else if (e->name == EVENT_STEP)
+	    len += sprintf(buf+len, "{\"name\":\"step\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":1,\"args\":{\"step\":%d}},\n",
+			   ts, dur, pid, e->bytes);
+	else
+	    len += sprintf(buf+len, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d},\n",
+			   hist_name(e->name), ts, dur, pid, e->name == EVENT_BATCH ? 1 : 0);
+    }
+    *lenp = len;
+    return buf;
+}
+
+/* Bytes of timeline moved to process 0 in each message */
+#define TIMELINE_PIECE (1 << 24)
+
+/*
+  Process 0 writes its own events, then receives those of every other
+  process in turn, in pieces of TIMELINE_PIECE bytes.  A long timeline
+  can run to gigabytes over all processes, beyond what an int count or
+  one buffer on process 0 can hold
+*/
+void write_timeline() {
+    char *fname = timeline_name;
+    int pid = 0;
+    int nzone = 1;
+    size_t len;
+    char *buf;
+    FILE *f = NULL;
+    if (fname == NULL)
+	return;
+    recording = false;
+#if MPI
+    MPI_Comm_size(MPI_COMM_WORLD, &nzone);
+    MPI_Comm_rank(MPI_COMM_WORLD, &pid);
+#endif
+    buf = format_events(pid, &len);
+    /* Drop final comma */
+    if (pid == nzone-1 && len >= 2)
+	len -= 2;
+    if (pid == 0) {
+	f = fopen(fname, "w");
+	if (f == NULL)
+	    fprintf(stderr, "Couldn't open timeline file %s\n", fname);
+    }
+    int ok = pid != 0 || f != NULL;
+#if MPI
+    char *piece = NULL;
+    if (pid == 0 && ok) {
+	piece = malloc(TIMELINE_PIECE);
+	if (piece == NULL) {
+	    fprintf(stderr, "Couldn't allocate space to gather timeline\n");
+	    fclose(f);
+	    ok = 0;
+	}
+    }
+    MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+#endif
+    if (!ok) {
+	free(buf);
+	return;
+    }
+    if (pid == 0) {
+	fprintf(f, "{\"traceEvents\":[\n");
+	if (buf != NULL)
+	    fwrite(buf, 1, len, f);
+    }
+#if MPI
+    int tag = 0;
+    if (pid != 0) {
+	long long llen = (long long) len;
+	size_t pos;
+	MPI_Send(&llen, 1, MPI_LONG_LONG, 0, tag, MPI_COMM_WORLD);
+	for (pos = 0; pos < len; pos += TIMELINE_PIECE) {
+	    int count = len - pos > TIMELINE_PIECE ? TIMELINE_PIECE : (int) (len - pos);
+	    MPI_Send(buf + pos, count, MPI_CHAR, 0, tag, MPI_COMM_WORLD);
+	}
+	free(buf);
+	return;
+    }
+    int zid;
+    for (zid = 1; zid < nzone; zid++) {
+	long long llen, pos;
+	MPI_Recv(&llen, 1, MPI_LONG_LONG, zid, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	for (pos = 0; pos < llen; pos += TIMELINE_PIECE) {
+	    int count = llen - pos > TIMELINE_PIECE ? TIMELINE_PIECE : (int) (llen - pos);
+	    MPI_Recv(piece, count, MPI_CHAR, zid, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	    fwrite(piece, 1, count, f);
+	}
+    }
+    free(piece);
+#endif
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(f);
+    free(buf);
+}
+
+/* Estimate of fraction p of histogram h, in seconds.  Upper edge of bucket, capped by max */
+static double hist_percentile(long long *h, double hmax, double p) {
+    long long total = 0;
+    int b;
+    for (b = 0; b < HIST_BUCKETS; b++)
+	total += h[b];
+    if (total == 0)
+	return 0.0;
+    long long target = (long long) (p * total + 0.5);
+    if (target < 1)
+	target = 1;
+    long long cum = 0;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+	cum += h[b];
+	if (cum >= target)
+	    break;
+    }
+    double edge = b + 1;
+    if (b >= HIST_SUB)
+	edge = (double) ((uint64_t) (HIST_SUB + 1 + b % HIST_SUB) << (b/HIST_SUB - 1));
+    edge *= 1e-9;
+    return edge < hmax ? edge : hmax;
+}
+
+static void show_histograms(FILE *f, long long h[HIST_COUNT][HIST_BUCKETS], double *hmax) {
+    int i, b;
+    fprintf(f, "Durations (us)           count       p50       p90       p99       max\n");
+    for (i = 1; i < HIST_COUNT; i++) {
+	long long total = 0;
+	for (b = 0; b < HIST_BUCKETS; b++)
+	    total += h[i][b];
+	if (total == 0)
+	    continue;
+	fprintf(f, "    %-16s %9lld %9.1f %9.1f %9.1f %9.1f\n", hist_name(i), total,
+		hist_percentile(h[i], hmax[i], 0.50) * 1e6,
+		hist_percentile(h[i], hmax[i], 0.90) * 1e6,
+		hist_percentile(h[i], hmax[i], 0.99) * 1e6,
+		hmax[i] * 1e6);
+    }
+}
+
+/*
+  Table of counters for each activity.  edge_visits[a] is the number of
+  edges processed by activity a, assuming each instance handles every
+  local edge
+*/
+static void show_counters(FILE *f, long long cnt[ACTIVITY_COUNT][COUNTER_COUNT], double *edge_visits) {
+    int a, c;
+    fprintf(f, "Counters     Mcycles    Minstr    IPC  LLC/edge   Kllc_miss  Kbr_miss\n");
+    for (a = 1; a < ACTIVITY_COUNT; a++) {
+	if (cnt[a][COUNTER_CYCLES] == 0)
+	    continue;
+	fprintf(f, "    ");
+	for (c = COUNTER_CYCLES; c <= COUNTER_INSTRUCTIONS; c++) {
+	    if (counter_slot[c] < 0)
+		fprintf(f, "%10s", "-");
+	    else
+		fprintf(f, "%10.1f", cnt[a][c] * 1e-6);
+	}
+	if (counter_slot[COUNTER_INSTRUCTIONS] < 0)
+	    fprintf(f, "%7s", "-");
+	else
+	    fprintf(f, "%7.2f", (double) cnt[a][COUNTER_INSTRUCTIONS] / cnt[a][COUNTER_CYCLES]);
+	if (counter_slot[COUNTER_LLC_MISSES] < 0 || edge_visits[a] == 0)
+	    fprintf(f, "%10s", "-");
+	else
+	    fprintf(f, "%10.3f", cnt[a][COUNTER_LLC_MISSES] / edge_visits[a]);
+	for (c = COUNTER_LLC_MISSES; c <= COUNTER_BRANCH_MISSES; c++) {
+	    if (counter_slot[c] < 0)
+		fprintf(f, "%12s", "-");
+	    else
+		fprintf(f, "%12.1f", cnt[a][c] * 1e-3);
+	}
+	fprintf(f, "    %s\n", activity_name[a]);
+    }
+}
+
+/* Number of instances of activity a, times number of local edges */
+static void get_edge_visits(int local_edge_count, double *edge_visits) {
+    int a, b;
+    for (a = 0; a < ACTIVITY_COUNT; a++) {
+	long long total = 0;
+	for (b = 0; b < HIST_BUCKETS; b++)
+	    total += hist[a][b];
+	edge_visits[a] = (double) total * local_edge_count;
+    }
+}
+
+static void show_steps(FILE *f, double *data, int nstep) {
+    int a, i;
+    fprintf(f, "Step  ");
+    for (a = 1; a < ACTIVITY_COUNT; a++)
+	fprintf(f, " %10.10s", activity_name[a]);
+    fprintf(f, "  max_count\n");
+    for (i = 0; i < nstep; i++) {
+	double *d = &data[i * STEP_DATA];
+	fprintf(f, "%6d", i+1);
+	for (a = 1; a < ACTIVITY_COUNT; a++)
+	    fprintf(f, " %10.3f", d[a] * 1000.0);
+	fprintf(f, " %10d\n", (int) d[ACTIVITY_COUNT]);
+    }
 }
 
 #if MPI
@@ -109,9 +779,19 @@ static void get_activity_data(int zid, double *data) {
 void show_activity(FILE *f, int local_node_count, int local_edge_count) {
     if (!tracking)
 	return;
-    init_instrument();
+    context_t *ctx = get_context();
+    if (ctx != main_context)
+	return;
     int a;
-    double elapsed = currentSeconds() - global_start_time;
+    /* Bring main thread up to date */
+    int olda = ctx->activity_stack[ctx->stack_level];
+    uint64_t now = currentTicks();
+    ctx->accum[olda] += now - ctx->current_start_time;
+    ctx->current_start_time = now;
+    if (counting)
+	update_counters(olda);
+    merge_contexts();
+    double elapsed = (now - global_start_time) * tick_seconds;
     double unknown = elapsed;
     for (a = 1; a < ACTIVITY_COUNT; a++)
 	unknown -= accum[a];
@@ -173,9 +853,52 @@ void show_activity(FILE *f, int local_node_count, int local_edge_count) {
 	}
 	fprintf(f, " %8.0f  %8.1f%8.1f\n",
 		data_max(rowdata, nzone), data_mean(rowdata, nzone), data_stddev(rowdata, nzone));
+	/* Waiting beyond what the least-waiting zone does is due to load imbalance */
+	double min_wait = zdata[0][ACTIVITY_WAIT];
+	for (zid = 1; zid < nzone; zid++)
+	    if (zdata[zid][ACTIVITY_WAIT] < min_wait)
+		min_wait = zdata[zid][ACTIVITY_WAIT];
+	fprintf(f, "Imbal   ");
+	for (zid = 0; zid < nzone; zid++) {
+	    int ms = (int) ((zdata[zid][ACTIVITY_WAIT] - min_wait) * 1000.0);
+	    rowdata[zid] = ms;
+	    fprintf(f, "%8d", ms);
+	}
+	fprintf(f, " %8.0f  %8.1f%8.1f    wait beyond minimum\n",
+		data_max(rowdata, nzone), data_mean(rowdata, nzone), data_stddev(rowdata, nzone));
     } else {
 	send_activity_data(local_node_count, local_edge_count);
     }
+    if (comm_tracking)
+	show_comm(f, this_zone);
+    /* Combine histograms over all zones.  Steps show slowest zone */
+    long long ghist[HIST_COUNT][HIST_BUCKETS];
+    double gmax[HIST_COUNT];
+    MPI_Reduce(hist, ghist, HIST_COUNT * HIST_BUCKETS, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(hist_max, gmax, HIST_COUNT, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (this_zone == 0)
+	show_histograms(f, ghist, gmax);
+    /* Counters summed over all zones.  Only when every process has them */
+    int all_counting = counting;
+    MPI_Allreduce(MPI_IN_PLACE, &all_counting, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (all_counting) {
+	long long gcnt[ACTIVITY_COUNT][COUNTER_COUNT];
+	double visits[ACTIVITY_COUNT];
+	double gvisits[ACTIVITY_COUNT];
+	get_edge_visits(local_edge_count, visits);
+	MPI_Reduce(counter_accum, gcnt, ACTIVITY_COUNT * COUNTER_COUNT, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(visits, gvisits, ACTIVITY_COUNT, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	if (this_zone == 0)
+	    show_counters(f, gcnt, gvisits);
+    }
+    if (steps_enabled) {
+	double *gdata = this_zone == 0 ? calloc(step_count * STEP_DATA + 1, sizeof(double)) : NULL;
+	MPI_Reduce(step_data, gdata, step_count * STEP_DATA, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+	if (this_zone == 0) {
+	    show_steps(f, gdata, step_count);
+	    free(gdata);
+	}
+    }
 #else
     fprintf(f, "    %8d zones %8d edges\n", local_node_count, local_edge_count);
     for (a = 0; a < ACTIVITY_COUNT; a++) {
@@ -186,5 +909,92 @@ void show_activity(FILE *f, int local_node_count, int local_edge_count) {
 	fprintf(f, "    %8d ms    %5.1f %%    %s\n", (int) ms, pct, activity_name[a]); 
     }
     fprintf(f, "    %8d ms    %5.1f %%    elapsed\n", (int) (elapsed * 1000.0), 100.0);
+    show_histograms(f, hist, hist_max);
+    if (counting) {
+	double visits[ACTIVITY_COUNT];
+	get_edge_visits(local_edge_count, visits);
+	show_counters(f, counter_accum, visits);
+    }
+    if (steps_enabled)
+	show_steps(f, step_data, step_count);
+#endif
+}
+
+void report_activity(FILE *f, int local_node_count, int local_edge_count) {
+    if (!tracking)
+	return;
+    int nzone = 1;
+    int this_zone = 0;
+    int a, zid, i, b;
+    double data[ACTIVITY_COUNT+2];
+    for (a = 0; a < ACTIVITY_COUNT; a++)
+	data[a] = accum[a];
+    data[ACTIVITY_COUNT] = (double) local_node_count;
+    data[ACTIVITY_COUNT+1] = (double) local_edge_count;
+    long long (*ghist)[HIST_BUCKETS] = hist;
+    double *gmax = hist_max;
+    long long *matrix = comm_row;
+#if MPI
+    MPI_Comm_size(MPI_COMM_WORLD, &nzone);
+    MPI_Comm_rank(MPI_COMM_WORLD, &this_zone);
+    double zdata[this_zone == 0 ? nzone : 1][ACTIVITY_COUNT+2];
+    long long rhist[HIST_COUNT][HIST_BUCKETS];
+    double rmax[HIST_COUNT];
+    MPI_Gather(data, ACTIVITY_COUNT+2, MPI_DOUBLE, zdata, ACTIVITY_COUNT+2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Reduce(hist, rhist, HIST_COUNT * HIST_BUCKETS, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(hist_max, rmax, HIST_COUNT, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    ghist = rhist;
+    gmax = rmax;
+    if (comm_tracking) {
+	int rowlen = nzone * COMM_COUNT;
+	matrix = this_zone == 0 ? calloc(nzone * rowlen, sizeof(long long)) : NULL;
+	long long dummy;
+	MPI_Gather(comm_row, rowlen, MPI_LONG_LONG, matrix ? matrix : &dummy, rowlen, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    }
+#else
+    double (*zdata)[ACTIVITY_COUNT+2] = &data;
+#endif
+    if (this_zone != 0 || f == NULL)
+	return;
+    fprintf(f, ",\n  \"zones\": [");
+    for (zid = 0; zid < nzone; zid++) {
+	fprintf(f, "%s\n    {\"zone\": %d, \"nodes\": %d, \"edges\": %d, \"seconds\": {",
+		zid == 0 ? "" : ",", zid, (int) zdata[zid][ACTIVITY_COUNT], (int) zdata[zid][ACTIVITY_COUNT+1]);
+	for (a = 0; a < ACTIVITY_COUNT; a++)
+	    fprintf(f, "%s\"%s\": %.6f", a == 0 ? "" : ", ", activity_name[a], zdata[zid][a]);
+	fprintf(f, "}}");
+    }
+    fprintf(f, "\n  ],\n  \"durations\": {");
+    bool first = true;
+    for (i = 1; i < HIST_COUNT; i++) {
+	long long total = 0;
+	for (b = 0; b < HIST_BUCKETS; b++)
+	    total += ghist[i][b];
+	if (total == 0)
+	    continue;
+	fprintf(f, "%s\n    \"%s\": {\"count\": %lld, \"p50\": %.9f, \"p90\": %.9f, \"p99\": %.9f, \"max\": %.9f}",
+		first ? "" : ",", hist_name(i), total,
+		hist_percentile(ghist[i], gmax[i], 0.50), hist_percentile(ghist[i], gmax[i], 0.90),
+		hist_percentile(ghist[i], gmax[i], 0.99), gmax[i]);
+	first = false;
+    }
+    fprintf(f, "\n  }");
+    if (comm_tracking && matrix != NULL) {
+	int src, dst;
+	first = true;
+	fprintf(f, ",\n  \"comm\": [");
+	for (src = 0; src < nzone; src++)
+	    for (dst = 0; dst < nzone; dst++) {
+		long long *val = &matrix[(src * nzone + dst) * COMM_COUNT];
+		if (val[COMM_MESSAGES] == 0)
+		    continue;
+		fprintf(f, "%s\n    {\"src\": %d, \"dst\": %d, \"messages\": %lld, \"bytes\": %lld, \"rats\": %lld}",
+			first ? "" : ",", src, dst, val[COMM_MESSAGES], val[COMM_BYTES], val[COMM_RATS]);
+		first = false;
+	    }
+	fprintf(f, "\n  ]");
+#if MPI
+	free(matrix);
 #endif
+    }
 }
@@ -9,7 +9,13 @@
 
 /* Categories of activities */
 
-typedef enum { ACTIVITY_NONE, ACTIVITY_STARTUP, ACTIVITY_WEIGHTS, ACTIVITY_SUMS, ACTIVITY_NEXT, ACTIVITY_COMM, ACTIVITY_GLOBAL_COMM, ACTIVITY_COUNT} activity_t;
+/*
+  ACTIVITY_PACK, ACTIVITY_WAIT, and ACTIVITY_UNPACK occur within
+  ACTIVITY_COMM, separating time spent filling and draining message
+  buffers from time blocked in MPI calls.  ACTIVITY_OUTPUT is writing
+  frames, possibly by the background writer thread
+*/
+typedef enum { ACTIVITY_NONE, ACTIVITY_STARTUP, ACTIVITY_WEIGHTS, ACTIVITY_SUMS, ACTIVITY_NEXT, ACTIVITY_COMM, ACTIVITY_PACK, ACTIVITY_WAIT, ACTIVITY_UNPACK, ACTIVITY_GLOBAL_COMM, ACTIVITY_REBALANCE, ACTIVITY_OUTPUT, ACTIVITY_COUNT} activity_t;
 
 void track_activity(bool enable);
 
@@ -17,16 +23,82 @@ void start_activity(activity_t a);
 void finish_activity(activity_t a);
 void show_activity(FILE *f, int local_node_count, int local_edge_count);
 
+/* Seconds spent so far in activity a.  Zero when not tracking */
+double activity_time(activity_t a);
+
+/*
+  Durations of every activity instance, batch, and step are kept in
+  log2-bucketed histograms.  With step tracking, also keep time spent
+  in each activity for every step, along with the largest node count
+*/
+void track_steps(bool enable);
+bool tracking_steps();
+void mark_batch();
+void mark_step(int step, int max_count);
+
+/*
+  Count cycles, instructions, LLC misses, and branch misses for each
+  activity, using Linux perf events.  Counters that can't be opened
+  are left out of the report
+*/
+void track_counters(bool enable);
+
+/*
+  Record timeline of activities, batches, steps, and messages for
+  every process.  write_timeline merges them into one file in Chrome
+  trace-event format, viewable with chrome://tracing or Perfetto.
+  Must be called by all processes
+*/
+void track_timeline(char *fname);
+void write_timeline();
+
+/*
+  Account for messages between zones.  show_activity prints matrices
+  of messages, bytes, and migrated rats sent from each zone to each
+  other zone.  With a file name, also write them as CSV
+*/
+void track_comm(char *fname);
+void record_message(bool send, int peer, int bytes);
+void record_rats(int peer, int nrat);
+
+/*
+  Write activity times for every zone, duration histograms, and
+  communication counts as members of a JSON object, each preceded by a
+  comma.  Process 0 writes to f.  Must be called by all processes,
+  after show_activity
+*/
+void report_activity(FILE *f, int local_node_count, int local_edge_count);
+
 #if TRACK
 #define TRACK_ACTIVITY(e) track_activity(e)
 #define START_ACTIVITY(a) start_activity(a)
 #define FINISH_ACTIVITY(a) finish_activity(a)
 #define SHOW_ACTIVITY(f,nn,ne) show_activity(f,nn,ne)
+#define TRACK_STEPS(e) track_steps(e)
+#define MARK_BATCH() mark_batch()
+#define MARK_STEP(s,c) mark_step(s,c)
+#define TRACK_COUNTERS(e) track_counters(e)
+#define TRACK_TIMELINE(f) track_timeline(f)
+#define WRITE_TIMELINE() write_timeline()
+#define TRACK_COMM(f) track_comm(f)
+#define RECORD_MESSAGE(s,p,b) record_message(s,p,b)
+#define RECORD_RATS(p,n) record_rats(p,n)
+#define REPORT_ACTIVITY(f,nn,ne) report_activity(f,nn,ne)
 #else
 #define TRACK_ACTIVITY(e)  /* Optimized out */
 #define START_ACTIVITY(a)   /* Optimized out */
 #define FINISH_ACTIVITY(a)  /* Optimized out */
 #define SHOW_ACTIVITY(f)  /* Optimized out */
+#define TRACK_STEPS(e)  /* Optimized out */
+#define MARK_BATCH()  /* Optimized out */
+#define MARK_STEP(s,c)  /* Optimized out */
+#define TRACK_COUNTERS(e)  /* Optimized out */
+#define TRACK_TIMELINE(f)  /* Optimized out */
+#define WRITE_TIMELINE()  /* Optimized out */
+#define TRACK_COMM(f)  /* Optimized out */
+#define RECORD_MESSAGE(s,p,b)  /* Optimized out */
+#define RECORD_RATS(p,n)  /* Optimized out */
+#define REPORT_ACTIVITY(f,nn,ne)  /* Optimized out */
 #endif
 
 #define INSTRUMENT_H
@@ -0,0 +1,432 @@
+#include <pthread.h>
+
+#include "crun.h"
+
+/*
+  Simulation output.  Frames are either printed directly by the simulator,
+  or handed off to a background writer thread.  In the latter case, the
+  simulator copies the rat counts into a free frame buffer and continues,
+  while the writer formats and prints queued frames in order.
+*/
+
+/*
+  Binary output format (-o binary or -o binary-abs).  All integers after
+  the fixed bytes are unsigned LEB128 varints.
+
+    Header:  "GRAT", version byte, flags byte, width, height, rat count
+    Frame:   'S', payload length in bytes, payload of N varints
+             'E' for a step shown without counts
+    Trailer: 'D'
+
+  With flag BINARY_DELTA, each payload value is the zigzag-encoded
+  difference from the node's count in the previous frame with counts
+  (zero before the first frame).  Otherwise it is the count itself.
+  With flag BINARY_RAW (shared file output, -O), the payload is instead
+  N 32-bit counts in host byte order, so that every frame has the same
+  size and each node's count has a fixed offset within it.
+*/
+#define BINARY_VERSION 1
+#define BINARY_DELTA 0x1
+#define BINARY_RAW 0x2
+
+static output_t output_format = OUTPUT_TEXT;
+static bool header_written = false;
+/* Counts of previous frame, for delta encoding.  Length = N */
+static int *last_counts = NULL;
+/* Encoding buffer.  Worst case 5 bytes per node */
+static unsigned char *encode_buf = NULL;
+
+/* Snapshot of one displayed step */
+typedef struct {
+    int width;
+    int height;
+    int nrat;
+    bool show_counts;
+    // Rat count for each node.  Length = N
+    int *counts;
+} frame_t;
+
+/* Circular queue of frames.  Frame at queue_head is being (or about to be) written */
+static frame_t *frame_queue = NULL;
+static int queue_depth = 0;
+static int queue_head = 0;
+static int queue_count = 0;
+
+/* When queue is full, replace newest waiting frame rather than waiting for writer */
+static bool drop_frames = false;
+static int dropped_frames = 0;
+
+static bool writer_running = false;
+static bool writer_finishing = false;
+static pthread_t writer_thread;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_nonempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_nonfull = PTHREAD_COND_INITIALIZER;
+
+/* Choose output format.  Return false if cannot allocate buffers */
+bool set_output_format(output_t format, int nnode) {
+    output_format = format;
+    if (format == OUTPUT_TEXT)
+	return true;
+    last_counts = int_alloc(nnode);
+    encode_buf = malloc(5 * (size_t) nnode + 1);
+    if (last_counts == NULL || encode_buf == NULL) {
+	outmsg("Couldn't allocate binary output buffers");
+	return false;
+    }
+    return true;
+}
+
+static inline unsigned char *put_varint(unsigned char *p, unsigned v) {
+    while (v >= 0x80) {
+	*p++ = (v & 0x7F) | 0x80;
+	v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static inline unsigned zigzag(int v) {
+    return ((unsigned) v << 1) ^ (unsigned) (v >> 31);
+}
+
+/* Encode file header at p.  Return position following it */
+static unsigned char *put_header(unsigned char *p, int width, int height, int nrat, int flags) {
+    memcpy(p, "GRAT", 4);
+    p += 4;
+    *p++ = BINARY_VERSION;
+    *p++ = flags;
+    p = put_varint(p, width);
+    p = put_varint(p, height);
+    p = put_varint(p, nrat);
+    return p;
+}
+
+static void write_binary_frame(int width, int height, int nrat, int *counts) {
+    unsigned char head[32];
+    unsigned char *p = head;
+    int nid;
+    int nnode = width * height;
+    bool delta = output_format == OUTPUT_BINARY;
+    if (!header_written) {
+	p = put_header(p, width, height, nrat, delta ? BINARY_DELTA : 0);
+	header_written = true;
+    }
+    if (counts == NULL) {
+	*p++ = 'E';
+	fwrite(head, 1, p - head, stdout);
+	return;
+    }
+    unsigned char *q = encode_buf;
+    if (delta) {
+	for (nid = 0; nid < nnode; nid++) {
+	    q = put_varint(q, zigzag(counts[nid] - last_counts[nid]));
+	    last_counts[nid] = counts[nid];
+	}
+    } else {
+	for (nid = 0; nid < nnode; nid++)
+	    q = put_varint(q, counts[nid]);
+    }
+    *p++ = 'S';
+    p = put_varint(p, q - encode_buf);
+    fwrite(head, 1, p - head, stdout);
+    fwrite(encode_buf, 1, q - encode_buf, stdout);
+}
+
+/*
+  Text frames are formatted into a single buffer, two digits at a time,
+  and written with one fwrite, rather than with a printf per node.
+*/
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* Text buffer.  Enough for N counts of up to 11 characters, plus newlines */
+static char *text_buf = NULL;
+static size_t text_buf_size = 0;
+
+/* Format v in decimal at p.  Return position following it */
+static inline char *put_int(char *p, int v) {
+    char digits[12];
+    char *d = digits + sizeof(digits);
+    unsigned u = v < 0 ? -(unsigned) v : (unsigned) v;
+    while (u >= 100) {
+	unsigned i = (u % 100) * 2;
+	u /= 100;
+	*--d = digit_pairs[i+1];
+	*--d = digit_pairs[i];
+    }
+    if (u >= 10) {
+	*--d = digit_pairs[2*u+1];
+	*--d = digit_pairs[2*u];
+    } else
+	*--d = '0' + u;
+    if (v < 0)
+	*--d = '-';
+    int len = digits + sizeof(digits) - d;
+    memcpy(p, d, len);
+    return p + len;
+}
+
+static void write_text_frame(int width, int height, int nrat, int *counts) {
+    int nid;
+    int nnode = width * height;
+    size_t need = 12 * ((size_t) nnode + 3) + 16;
+    if (need > text_buf_size) {
+	free(text_buf);
+	text_buf = malloc(need);
+	text_buf_size = text_buf == NULL ? 0 : need;
+	if (text_buf == NULL) {
+	    outmsg("Couldn't allocate output buffer");
+	    exit(1);
+	}
+    }
+    char *p = text_buf;
+    memcpy(p, "STEP ", 5);
+    p += 5;
+    p = put_int(p, width);
+    *p++ = ' ';
+    p = put_int(p, height);
+    *p++ = ' ';
+    p = put_int(p, nrat);
+    *p++ = '\n';
+    if (counts != NULL) {
+	for (nid = 0; nid < nnode; nid++) {
+	    p = put_int(p, counts[nid]);
+	    *p++ = '\n';
+	}
+    }
+    memcpy(p, "END\n", 4);
+    p += 4;
+    fwrite(text_buf, 1, p - text_buf, stdout);
+}
+
+/* Print one frame.  counts == NULL when not showing counts */
+void write_frame(int width, int height, int nrat, int *counts) {
+    if (output_format == OUTPUT_TEXT)
+	write_text_frame(width, height, nrat, counts);
+    else
+	write_binary_frame(width, height, nrat, counts);
+}
+
+/* Mark end of output */
+void write_done() {
+    if (output_format == OUTPUT_TEXT)
+	printf("DONE\n");
+    else
+	fputc('D', stdout);
+}
+
+static void *writer_loop(void *arg) {
+    pthread_mutex_lock(&queue_lock);
+    while (true) {
+	while (queue_count == 0 && !writer_finishing)
+	    pthread_cond_wait(&queue_nonempty, &queue_lock);
+	if (queue_count == 0)
+	    break;
+	/* Only the head frame is read outside the lock.  The simulator never touches it */
+	frame_t *f = &frame_queue[queue_head];
+	pthread_mutex_unlock(&queue_lock);
+	START_ACTIVITY(ACTIVITY_OUTPUT);
+	write_frame(f->width, f->height, f->nrat, f->show_counts ? f->counts : NULL);
+	FINISH_ACTIVITY(ACTIVITY_OUTPUT);
+	pthread_mutex_lock(&queue_lock);
+	queue_head = (queue_head + 1) % queue_depth;
+	queue_count--;
+	pthread_cond_signal(&queue_nonfull);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    fflush(stdout);
+    return NULL;
+}
+
+/*
+  Start background writer with room for depth frames of up to nnode counts (at least 2, so that
+  one frame can be filled while another is written).
+  Return false if cannot allocate buffers or start thread
+*/
+bool start_writer(int nnode, int depth, bool drop) {
+    int i;
+    if (depth < 2)
+	depth = 2;
+    frame_queue = calloc(depth, sizeof(frame_t));
+    if (frame_queue == NULL) {
+	outmsg("Couldn't allocate output frame queue");
+	return false;
+    }
+    for (i = 0; i < depth; i++) {
+	frame_queue[i].counts = int_alloc(nnode);
+	if (frame_queue[i].counts == NULL) {
+	    outmsg("Couldn't allocate output frame buffers");
+	    return false;
+	}
+    }
+    queue_depth = depth;
+    queue_head = 0;
+    queue_count = 0;
+    drop_frames = drop;
+    dropped_frames = 0;
+    writer_finishing = false;
+    if (pthread_create(&writer_thread, NULL, writer_loop, NULL) != 0) {
+	outmsg("Couldn't start output thread");
+	return false;
+    }
+    writer_running = true;
+    return true;
+}
+
+/*
+  Hand off copy of frame to writer.  Blocks while the queue is full,
+  unless dropping frames.  Return false if no writer is running,
+  in which case caller should print the frame itself.
+*/
+static bool queue_frame(int width, int height, int nrat, int *counts) {
+    frame_t *f;
+    if (!writer_running)
+	return false;
+    pthread_mutex_lock(&queue_lock);
+    if (queue_count == queue_depth && drop_frames) {
+	/* Overwrite newest waiting frame.  Depth >= 2, so it isn't the one being written */
+	f = &frame_queue[(queue_head + queue_count - 1) % queue_depth];
+	dropped_frames++;
+    } else {
+	while (queue_count == queue_depth)
+	    pthread_cond_wait(&queue_nonfull, &queue_lock);
+	f = &frame_queue[(queue_head + queue_count) % queue_depth];
+	queue_count++;
+    }
+    f->width = width;
+    f->height = height;
+    f->nrat = nrat;
+    f->show_counts = counts != NULL;
+    if (counts != NULL)
+	memcpy(f->counts, counts, width * height * sizeof(int));
+    pthread_cond_signal(&queue_nonempty);
+    pthread_mutex_unlock(&queue_lock);
+    return true;
+}
+
+/* Output frame, through writer if one is running.  counts == NULL when not showing counts */
+void emit_frame(int width, int height, int nrat, int *counts) {
+    if (!queue_frame(width, height, nrat, counts)) {
+	START_ACTIVITY(ACTIVITY_OUTPUT);
+	write_frame(width, height, nrat, counts);
+	FINISH_ACTIVITY(ACTIVITY_OUTPUT);
+    }
+}
+
+/* Write out all queued frames and stop writer */
+void finish_writer() {
+    int i;
+    if (!writer_running)
+	return;
+    pthread_mutex_lock(&queue_lock);
+    writer_finishing = true;
+    pthread_cond_signal(&queue_nonempty);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(writer_thread, NULL);
+    writer_running = false;
+    for (i = 0; i < queue_depth; i++)
+	free(frame_queue[i].counts);
+    free(frame_queue);
+    frame_queue = NULL;
+    if (dropped_frames > 0)
+	outmsg("Output writer dropped %d frames", dropped_frames);
+}
+
+#if MPI
+/*
+  Shared file output.  Every process writes the counts of its own nodes
+  straight into each frame of the file with a collective write, through a
+  file view that scatters them to their node offsets.  Process 0 only adds
+  the header and frame tags.  All processes track the file offset, since
+  they all see the same sequence of frames.
+*/
+static bool shared_output = false;
+static MPI_File shared_fh;
+static MPI_Offset shared_offset = 0;
+/* Local counts to write.  Length = local node count */
+static int *shared_buf = NULL;
+
+/* Open shared output file.  Collective.  Return false if cannot open */
+bool open_shared_output(char *fname, graph_t *g, int nrat) {
+    unsigned char head[32];
+    int this_zone;
+    MPI_Comm_rank(MPI_COMM_WORLD, &this_zone);
+    if (MPI_File_open(MPI_COMM_WORLD, fname, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+		      MPI_INFO_NULL, &shared_fh) != MPI_SUCCESS) {
+	outmsg("Couldn't open output file %s\n", fname);
+	return false;
+    }
+    MPI_File_set_size(shared_fh, 0);
+    unsigned char *p = put_header(head, g->width, g->height, nrat, BINARY_RAW);
+    if (this_zone == 0)
+	MPI_File_write_at(shared_fh, 0, head, p - head, MPI_BYTE, MPI_STATUS_IGNORE);
+    shared_offset = p - head;
+    shared_output = true;
+    return true;
+}
+
+bool shared_output_active() {
+    return shared_output;
+}
+
+/* Write frame to shared file.  Collective */
+void write_shared_frame(state_t *s, bool show_counts) {
+    graph_t *g = s->g;
+    unsigned char head[8];
+    unsigned char *p = head;
+    int count = g->local_node_count;
+    int i;
+
+    START_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+    *p++ = show_counts ? 'S' : 'E';
+    if (show_counts)
+	p = put_varint(p, 4 * g->nnode);
+    if (g->this_zone == 0)
+	MPI_File_write_at(shared_fh, shared_offset, head, p - head, MPI_BYTE, MPI_STATUS_IGNORE);
+    shared_offset += p - head;
+    if (!show_counts) {
+	FINISH_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+	return;
+    }
+
+    /* The zone can change when rebalancing, so build its file type for each frame */
+    MPI_Datatype zone_type;
+    MPI_Type_create_indexed_block(count, 1, g->local_node_list, MPI_INT, &zone_type);
+    MPI_Type_commit(&zone_type);
+    shared_buf = realloc(shared_buf, (count + 1) * sizeof(int));
+    if (shared_buf == NULL) {
+	outmsg("Couldn't allocate output buffer");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < count; i++)
+	shared_buf[i] = s->rat_count[g->local_node_list[i]];
+    MPI_File_set_view(shared_fh, shared_offset, MPI_INT, zone_type, "native", MPI_INFO_NULL);
+    MPI_File_write_all(shared_fh, shared_buf, count, MPI_INT, MPI_STATUS_IGNORE);
+    MPI_File_set_view(shared_fh, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+    MPI_Type_free(&zone_type);
+    shared_offset += 4 * (MPI_Offset) g->nnode;
+    FINISH_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+}
+
+/* Mark end of output and close file.  Collective */
+void close_shared_output(state_t *s) {
+    if (!shared_output)
+	return;
+    if (s->g->this_zone == 0)
+	MPI_File_write_at(shared_fh, shared_offset, "D", 1, MPI_BYTE, MPI_STATUS_IGNORE);
+    MPI_File_close(&shared_fh);
+    free(shared_buf);
+    shared_buf = NULL;
+    shared_output = false;
+}
+#endif
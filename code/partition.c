@@ -204,3 +204,24 @@ void assign_zones(region_t *region_list, int nregion, int nzone) {
       }
     }
 }
+
+/*
+  Rebalancing partitioner.  Keeps regions in their original order, so
+  that each zone remains a contiguous run of regions, and splits that
+  sequence to minimize the variance of the measured zone costs.
+*/
+void reassign_zones(region_t *region_list, int nregion, int nzone, double *region_weight) {
+    int zones[nzone];
+    int rid, zid;
+
+    find_partition(nregion, nzone, region_weight, zones);
+
+    rid = 0;
+    for (zid = 0; zid < nzone; zid++) {
+        int end_rid = rid + zones[zid];
+        while (rid < end_rid) {
+            region_list[rid].zone_id = zid;
+            rid++;
+        }
+    }
+}
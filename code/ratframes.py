@@ -0,0 +1,141 @@
+#!/usr/bin/python
+
+# Reader for binary simulator output (crun -o binary or -o binary-abs, or crun-mpi -O OFILE)
+# Can also be run as a program to convert binary output back into text format,
+# e.g., ./ratframes.py -i run.bin | ./grun.py -d -v h
+
+import sys
+import getopt
+import array
+
+MAGIC = "GRAT"
+VERSION = 1
+DELTA = 0x1
+# Frames written to shared file (crun-mpi -O) hold 32-bit counts in host byte order
+RAW = 0x2
+
+class FormatError(Exception):
+    pass
+
+class FrameReader:
+    infile = None
+    width = 0
+    height = 0
+    nrats = 0
+    delta = False
+    raw = False
+    lastCounts = []
+
+    def __init__(self, infile):
+        self.infile = infile
+        magic = infile.read(4)
+        if magic != MAGIC:
+            raise FormatError("Not a binary rat output file")
+        version = ord(infile.read(1))
+        if version != VERSION:
+            raise FormatError("Unknown format version %d" % version)
+        flags = ord(infile.read(1))
+        self.delta = (flags & DELTA) != 0
+        self.raw = (flags & RAW) != 0
+        self.width = self.readVarint()
+        self.height = self.readVarint()
+        self.nrats = self.readVarint()
+        self.lastCounts = [0] * (self.width * self.height)
+
+    def readVarint(self):
+        val = 0
+        shift = 0
+        while True:
+            c = self.infile.read(1)
+            if c == "":
+                raise FormatError("Unexpected end of file")
+            b = ord(c)
+            val |= (b & 0x7F) << shift
+            if b < 0x80:
+                return val
+            shift += 7
+
+    def decode(self, payload):
+        if self.raw:
+            counts = array.array('i')
+            counts.fromstring(payload)
+            if len(counts) != self.width * self.height:
+                raise FormatError("Frame has %d counts.  Expected %d" % (len(counts), self.width * self.height))
+            return counts.tolist()
+        counts = []
+        val = 0
+        shift = 0
+        for b in bytearray(payload):
+            val |= (b & 0x7F) << shift
+            if b < 0x80:
+                counts.append(val)
+                val = 0
+                shift = 0
+            else:
+                shift += 7
+        if len(counts) != self.width * self.height:
+            raise FormatError("Frame has %d counts.  Expected %d" % (len(counts), self.width * self.height))
+        if self.delta:
+            # Undo zigzag encoding and add to previous counts
+            for i in xrange(len(counts)):
+                v = counts[i]
+                counts[i] = self.lastCounts[i] + ((v >> 1) ^ -(v & 1))
+        self.lastCounts = counts
+        return counts
+
+    # Return list of counts for next frame, empty list for frame without counts,
+    # or None when reach end of output
+    def nextFrame(self):
+        tag = self.infile.read(1)
+        if tag == "D" or tag == "":
+            return None
+        if tag == "E":
+            return []
+        if tag != "S":
+            raise FormatError("Invalid frame tag '%s'" % tag)
+        length = self.readVarint()
+        payload = self.infile.read(length)
+        if len(payload) != length:
+            raise FormatError("Unexpected end of file")
+        return self.decode(payload)
+
+    # Iterate over frames
+    def frames(self):
+        while True:
+            counts = self.nextFrame()
+            if counts is None:
+                return
+            yield counts
+
+def usage(name):
+    print "Usage: %s [-h] [-i BFILE]" % name
+    print "\t-h        Print this message"
+    print "\t-i BFILE  Binary input file (default stdin)"
+    print "Converts binary simulator output to text format on stdout"
+    sys.exit(0)
+
+def run(name, args):
+    infile = sys.stdin
+    optlist, args = getopt.getopt(args, "hi:")
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-i':
+            try:
+                infile = open(val, 'rb')
+            except Exception as e:
+                print "Couldn't open binary file '%s'" % val
+                return
+    try:
+        reader = FrameReader(infile)
+        for counts in reader.frames():
+            sys.stdout.write("STEP %d %d %d\n" % (reader.width, reader.height, reader.nrats))
+            if len(counts) > 0:
+                sys.stdout.write("\n".join([str(c) for c in counts]) + "\n")
+            sys.stdout.write("END\n")
+        sys.stdout.write("DONE\n")
+    except FormatError as e:
+        sys.stderr.write("Error reading binary output: %s\n" % e)
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
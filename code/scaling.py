@@ -0,0 +1,290 @@
+#!/usr/bin/python
+
+# Strong and weak scaling suite for the C simulators.
+# Runs hlbrt graphs of increasing size over a range of process counts and
+# load factors, and records parallel efficiency.  The simulators generate
+# their graphs and rats in memory (-G and -L), so no input files are needed.
+#
+# Strong scaling: graph size fixed, process count varies.
+# Weak scaling: graph side grows with sqrt(P), so nodes per process stay fixed.
+#
+# Efficiency is throughput (rat moves per second) per process, relative to the
+# smallest process count in the same series.
+
+import subprocess
+import sys
+import os
+import os.path
+import getopt
+import math
+import datetime
+import json
+import tempfile
+
+def usage(fname):
+    ustring = "Usage: %s [-h][-S][-W] [-s S1:S2:..:Sk] [-w BASE] [-p P1:P2:..:Pk] [-l L1:L2:..:Lk] [-m MODE] [-n NSTEP] [-r RUNS] [-R REGIONS] [-M FLAGS] [-f CSVFILE] [-c OLDCSV]" % fname
+    print ustring
+    print "    -h            Print this message"
+    print "    -S            Run only strong-scaling series"
+    print "    -W            Run only weak-scaling series"
+    print "    -s S1:..:Sk   Graph sides (in nodes) for strong scaling (default %s)" % ":".join([str(s) for s in defaultSizes])
+    print "    -w BASE       Graph side for one process in weak scaling (default %d)" % defaultWeakBase
+    print "    -p P1:..:Pk   Process counts.  P = 1 runs crun-seq, otherwise crun-mpi (default %s)" % ":".join([str(p) for p in defaultProcessCounts])
+    print "    -l L1:..:Lk   Load factors (rats per node) (default %s)" % ":".join([str(l) for l in defaultLoads])
+    print "    -m MODE       Initial rat distribution: r(andom), u(niform), d(iagonal) or c(enter) (default r)"
+    print "    -n NSTEP      Number of simulation steps (default %d)" % defaultSteps
+    print "    -r RUNS       Number of times each configuration is run.  Fastest run is recorded (default %d)" % defaultRuns
+    print "    -R REGIONS    Number of regions in generated graphs (default %d)" % defaultRegions
+    print "    -M FLAGS      Extra flags for mpirun, as a single space-separated string"
+    print "    -f CSVFILE    Write results to CSVFILE"
+    print "    -c OLDCSV     Compare against results from a previous run"
+    print "The largest default sizes need many GB of memory at high loads, and minutes per step.  Use -s to limit them"
+    sys.exit(0)
+
+simProgram = "./crun-seq"
+mpiSimProgram = "./crun-mpi"
+
+defaultSizes = [160, 320, 640, 1280, 2048, 4096]
+defaultWeakBase = 160
+defaultProcessCounts = [1, 2, 4, 8]
+defaultLoads = [10, 40]
+defaultSteps = 20
+defaultRuns = 3
+defaultRegions = 100
+
+ratModes = "rudc"
+
+# Weak-scaling graph sides are rounded to multiples of this
+sideQuantum = 8
+
+mpiFlags = []
+runCount = defaultRuns
+regionCount = defaultRegions
+ratMode = 'r'
+
+csvFields = ["series", "width", "height", "nodes", "load", "mode", "procs", "nodes_per_proc", "steps",
+             "secs", "wall_secs", "npm", "mrps", "efficiency"]
+
+outFile = None
+
+def outmsg(s, noreturn = False):
+    if len(s) > 0 and s[-1] != '\n' and not noreturn:
+        s += "\n"
+    sys.stdout.write(s)
+    sys.stdout.flush()
+
+# Graph and rat specifications for the simulators' -G and -L options
+def graphSpec(side):
+    return "%dx%d:%d" % (side, side, regionCount)
+
+def ratSpec(load):
+    return "%s%d" % (ratMode, load)
+
+# Run simulator once.  Return (simulation seconds, wall seconds), or None on failure
+def doRun(cmdList, reportName):
+    cmdLine = " ".join(cmdList)
+    tstart = datetime.datetime.now()
+    try:
+        outmsg("Running '%s'" % cmdLine)
+        simProcess = subprocess.Popen(cmdList, stdout = subprocess.PIPE, stderr = subprocess.PIPE)
+        (out, err) = simProcess.communicate()
+        returnCode = simProcess.returncode
+    except Exception as e:
+        print "Execution of command '%s' failed. %s" % (cmdLine, e)
+        return None
+    if returnCode != 0:
+        # Instrumentation summary goes to stderr on every run.  Only show it when something went wrong
+        for line in err.split('\n'):
+            if line != "":
+                outmsg(line)
+        print "Execution of command '%s' gave return code %d" % (cmdLine, returnCode)
+        return None
+    delta = datetime.datetime.now() - tstart
+    wallSecs = delta.seconds + 24 * 3600 * delta.days + 1e-6 * delta.microseconds
+    try:
+        rfile = open(reportName, 'r')
+        report = json.load(rfile)
+        rfile.close()
+    except Exception as e:
+        print "Couldn't read run report '%s' (%s)" % (reportName, str(e))
+        return None
+    return (report["seconds"], wallSecs)
+
+def bestRun(side, load, processCount, stepCount):
+    reportName = os.path.join(tempfile.gettempdir(), "scaling-report-%d.json" % os.getpid())
+    preList = []
+    prog = simProgram
+    if processCount > 1:
+        preList = ['mpirun', '-np', str(processCount)] + mpiFlags
+        prog = mpiSimProgram
+    cmd = preList + [prog, "-G", graphSpec(side), "-L", ratSpec(load),
+                     "-n", str(stepCount), "-q", "-J", reportName]
+    best = None
+    for r in range(runCount):
+        if runCount > 1:
+            outmsg("Run #%d:" % (r+1), noreturn = True)
+        result = doRun(cmd, reportName)
+        if result is None:
+            return None
+        if best is None or result[0] < best[0]:
+            best = result
+    if os.path.exists(reportName):
+        os.remove(reportName)
+    return best
+
+def runSeries(series, configList, load, stepCount):
+    resultList = []
+    baseRate = None
+    for (side, processCount) in configList:
+        nodes = side * side
+        result = bestRun(side, load, processCount, stepCount)
+        if result is None:
+            continue
+        secs, wallSecs = result
+        rmoves = nodes * load * stepCount
+        rate = rmoves / secs if secs > 0 else 0.0
+        # Throughput per process, relative to the first configuration in the series
+        if baseRate is None:
+            baseRate = rate / processCount
+        efficiency = (rate / processCount) / baseRate if baseRate > 0 else 0.0
+        results = {"series" : series, "width" : side, "height" : side, "nodes" : nodes,
+                   "load" : load, "mode" : ratMode, "procs" : processCount,
+                   "nodes_per_proc" : nodes // processCount, "steps" : stepCount,
+                   "secs" : "%.3f" % secs, "wall_secs" : "%.3f" % wallSecs,
+                   "npm" : "%.2f" % (1e9 * secs / rmoves), "mrps" : "%.2f" % (1e-6 * rate),
+                   "efficiency" : "%.3f" % efficiency}
+        resultList.append(results)
+    return resultList
+
+def weakSide(base, processCount):
+    side = int(round(base * math.sqrt(processCount) / sideQuantum)) * sideQuantum
+    return max(side, sideQuantum)
+
+def resultKey(r):
+    return (r["series"], str(r["width"]), str(r["load"]), r["mode"], str(r["procs"]), str(r["steps"]))
+
+def loadResults(fname):
+    try:
+        f = open(fname, 'r')
+    except Exception as e:
+        outmsg("Couldn't open previous results '%s' (%s)" % (fname, str(e)))
+        return None
+    rdict = {}
+    fields = None
+    for line in f:
+        line = line.strip()
+        if len(line) == 0 or line[0] == '#':
+            continue
+        values = line.split(',')
+        if fields is None:
+            fields = values
+            continue
+        r = dict(zip(fields, values))
+        rdict[resultKey(r)] = r
+    f.close()
+    return rdict
+
+def formatTitle(compare):
+    ls = ["Series", "side", "load", "procs", "secs", "NPM", "MRPS", "Eff"]
+    if compare:
+        ls += ["OldNPM", "Ratio"]
+    return "\t".join(ls)
+
+def formatResult(r, oldResults):
+    ls = [r["series"], str(r["width"]), str(r["load"]), str(r["procs"]), r["secs"], r["npm"], r["mrps"], r["efficiency"]]
+    if oldResults is not None:
+        key = resultKey(r)
+        if key in oldResults:
+            onpm = float(oldResults[key]["npm"])
+            ls += ["%.2f" % onpm, "%.2f" % (onpm / float(r["npm"]))]
+        else:
+            ls += ["--", "--"]
+    return "\t".join(ls)
+
+def run(name, args):
+    global mpiFlags, runCount, regionCount, ratMode, outFile
+    sizes = defaultSizes
+    weakBase = defaultWeakBase
+    processCounts = defaultProcessCounts
+    loads = defaultLoads
+    stepCount = defaultSteps
+    doStrong = True
+    doWeak = True
+    oldResults = None
+    optlist, args = getopt.getopt(args, "hSWs:w:p:l:m:n:r:R:M:f:c:")
+    try:
+        for (opt, val) in optlist:
+            if opt == '-h':
+                usage(name)
+            elif opt == '-S':
+                doWeak = False
+            elif opt == '-W':
+                doStrong = False
+            elif opt == '-s':
+                sizes = [int(s) for s in val.split(":")]
+            elif opt == '-w':
+                weakBase = int(val)
+            elif opt == '-p':
+                processCounts = [int(s) for s in val.split(":")]
+            elif opt == '-l':
+                loads = [int(s) for s in val.split(":")]
+            elif opt == '-m':
+                if len(val) != 1 or val not in ratModes:
+                    print "Invalid rat mode '%s'" % val
+                    usage(name)
+                ratMode = val
+            elif opt == '-n':
+                stepCount = int(val)
+            elif opt == '-r':
+                runCount = int(val)
+            elif opt == '-R':
+                regionCount = int(val)
+            elif opt == '-M':
+                mpiFlags = val.split()
+            elif opt == '-f':
+                try:
+                    outFile = open(val, "w")
+                except Exception as e:
+                    outmsg("Couldn't open output file '%s' (%s)" % (val, str(e)))
+                    return
+            elif opt == '-c':
+                oldResults = loadResults(val)
+                if oldResults is None:
+                    return
+    except ValueError:
+        print "Numeric arguments must be given as integers or colon-separated lists of integers"
+        usage(name)
+    if min(processCounts) < 1:
+        print "Cannot have process count < 1"
+        usage(name)
+    processCounts.sort()
+
+    tstart = datetime.datetime.now()
+    resultList = []
+    if doStrong:
+        for side in sizes:
+            for load in loads:
+                outmsg("+++++++++++++++++ Strong scaling %dx%d, load %d" % (side, side, load))
+                resultList += runSeries("strong", [(side, p) for p in processCounts], load, stepCount)
+    if doWeak:
+        for load in loads:
+            outmsg("+++++++++++++++++ Weak scaling %dx%d per process, load %d" % (weakBase, weakBase, load))
+            resultList += runSeries("weak", [(weakSide(weakBase, p), p) for p in processCounts], load, stepCount)
+
+    outmsg("+++++++++++++++++")
+    outmsg(formatTitle(oldResults is not None))
+    for r in resultList:
+        outmsg(formatResult(r, oldResults))
+    if outFile is not None:
+        tgen = datetime.datetime.now()
+        outFile.write("# Generated %s\n" % tgen.ctime())
+        outFile.write(",".join(csvFields) + "\n")
+        for r in resultList:
+            outFile.write(",".join([str(r[f]) for f in csvFields]) + "\n")
+        outFile.close()
+    delta = datetime.datetime.now() - tstart
+    secs = delta.seconds + 24 * 3600 * delta.days + 1e-6 * delta.microseconds
+    print("Overall scaling time = %.1f secs." % (secs))
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
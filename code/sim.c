@@ -38,9 +38,9 @@ static inline double compute_weight(state_t *s, int nid) {
 
 /* Recompute all node counts according to rat population */
 /*
-  Function only called at start of simulation, at which point
-  every zone has complete rat information.  Can therefore
-  have every zone update every node count.
+  Function only called at start of simulation.  A zone may know only
+  its own rats, in which case counts of nodes in other zones
+  must be imported afterwards.
 */
 static inline void take_census(state_t *s) {
     graph_t *g = s->g;
@@ -52,7 +52,8 @@ static inline void take_census(state_t *s) {
     memset(rat_count, 0, nnode * sizeof(int));
     int ri;
     for (ri = 0; ri < nrat; ri++) {
-	rat_count[rat_position[ri]]++;
+	if (rat_position[ri] >= 0)
+	    rat_count[rat_position[ri]]++;
     }
 }
 
@@ -274,14 +275,67 @@ static inline void do_batch(state_t *s, int batch, int bstart, int bcount) {
     /* Update weights */
     
 #if MPI
-    exchange_rats(s);
-    exchange_node_states(s);
+    if (!s->standalone) {
+	exchange_rats(s);
+	exchange_node_states(s);
+	compute_all_weights(s);
+	exchange_node_weights(s);
+	return;
+    }
+#endif
     compute_all_weights(s);
-    exchange_node_weights(s);
+}
+
+/* Compute counts and weights for initial state */
+static void start_state(state_t *s) {
+    take_census(s);
+#if MPI
+    if (!s->standalone)
+	exchange_node_states(s);
+#endif
+    compute_all_weights(s);
+#if MPI
+    if (!s->standalone)
+	exchange_node_weights(s);
 #endif
 }
 
-static void batch_step(state_t *s) {
+#if MPI
+/*
+  Compare state with shadow sequential run on process 0.  Hashes are
+  compared first.  If they differ, the counts are gathered to find the
+  first node that diverged.  batch < 0 for initial state.
+*/
+static void check_shadow(state_t *s, int step, int batch) {
+    int this_zone = s->g->this_zone;
+    int diverged = 0;
+    int nid;
+    uint64_t hash = hash_state(s, 2);
+    if (this_zone == 0)
+	diverged = hash != hash_state(s->shadow, 2);
+    MPI_Bcast(&diverged, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!diverged)
+	return;
+    s->validate = false;
+    s->diverged = true;
+    if (this_zone != 0) {
+	send_node_state(s);
+	return;
+    }
+    gather_node_state(s);
+    for (nid = 0; nid < s->g->nnode; nid++) {
+	if (s->rat_count[nid] != s->shadow->rat_count[nid]) {
+	    outmsg("Validation failed.  Step %d, batch %d: node %d has %d rats.  Sequential run has %d\n",
+		   step, batch, nid, s->rat_count[nid], s->shadow->rat_count[nid]);
+	    return;
+	}
+    }
+    outmsg("Validation failed.  Step %d, batch %d: node counts match sequential run, but rat positions differ\n",
+	   step, batch);
+}
+#endif
+
+static void batch_step(state_t *s, int step) {
     int bstart = 0;
     int bsize = s->batch_size;
     int nrat = s->nrat;
@@ -292,56 +346,102 @@ static void batch_step(state_t *s) {
 	if (bcount > bsize)
 	    bcount = bsize;
 	do_batch(s, batch, bstart, bcount);
+	MARK_BATCH();
+#if MPI
+	if (s->validate) {
+	    if (s->shadow != NULL)
+		do_batch(s->shadow, batch, bstart, bcount);
+	    check_shadow(s, step, batch);
+	}
+#endif
 	batch++;
 	bstart += bcount;
     }
 }
 
+/* Output state of simulation.  Under MPI, called by all processes */
+static void display_step(state_t *s, int step, bool show_counts) {
+    if (s->display_hash > 0) {
+	show_hash(s, step);
+	return;
+    }
+    if (s->display_stats) {
+	show_stats(s, step);
+	return;
+    }
+    if (s->display_tile > 0) {
+	show_tiles(s, show_counts);
+	return;
+    }
+#if MPI
+    if (shared_output_active()) {
+	// Every process writes its own zone into the shared file
+	write_shared_frame(s, show_counts);
+    } else if (s->g->this_zone == 0) {
+	// Process 0 may only hold its own zone's rats.
+	// When show_counts is true, it needs the counts for all other zones.
+	// These must be gathered from the other processes.
+	if (show_counts)
+	    gather_node_state(s);
+	show(s, show_counts);
+    } else if (show_counts) {
+	// Send counts to process 0
+	send_node_state(s);
+    }
+#else
+    show(s, show_counts);
+#endif
+}
+
+/* Largest count of any node in zone.  For instrumentation */
+static int max_local_count(state_t *s) {
+    graph_t *g = s->g;
+    int i;
+    int max_count = 0;
+    for (i = 0; i < g->local_node_count; i++) {
+	int count = s->rat_count[g->local_node_list[i]];
+	if (count > max_count)
+	    max_count = count;
+    }
+    return max_count;
+}
+
 double simulate(state_t *s, int count, int dinterval, bool display) {
     int i;
     /* Compute and show initial state */
     bool show_counts = true;
     double start = currentSeconds();
-    take_census(s);
-    compute_all_weights(s);
-    
-    
-    
-    if (display) {
+    start_state(s);
 #if MPI
-    //exchange_node_states(s);
-    exchange_node_weights(s);
-
-	if (s->g->this_zone == 0)
-	    // Process 0 has a copy of the initial counts for all nodes.
-	    show(s, show_counts);
-#else
-	    show(s, show_counts);
-#endif
+    if (s->validate) {
+	if (s->shadow != NULL)
+	    start_state(s->shadow);
+	check_shadow(s, 0, -1);
     }
+#endif
+    if (s->check_trace)
+	check_trace(s, 0);
+    
+    if (display)
+	display_step(s, 0, show_counts);
+    MARK_STEP(0, 0);
     for (i = 0; i < count; i++) {
-	    batch_step(s);
+	    batch_step(s, i+1);
+	    if (s->check_trace)
+		check_trace(s, i+1);
 	    if (display) {
 	        show_counts = (((i+1) % dinterval) == 0) || (i == count-1);
+	        display_step(s, i+1, show_counts);
+	    }
 #if MPI
-            if (s->g->this_zone == 0) {
-            // Process 0 needs to call function show on each simulation step.
-            // When show_counts is true, it will need to have
-            // the counts for all other zones.
-            // These must be gathered from the other processes.
-            if (show_counts)
-                gather_node_state(s);
-                show(s, show_counts);
-            } 
-            else {
-                if (show_counts)
-                    // Send counts to process 0
-                    send_node_state(s);
-                }
-#else
-	        show(s, show_counts);
-#endif
+        if (s->rebalance_interval > 0 && (i+1) % s->rebalance_interval == 0 && i < count-1) {
+            if (rebalance_zones(s)) {
+                compute_all_weights(s);
+                exchange_node_weights(s);
+            }
         }
+#endif
+	MARK_STEP(i+1, tracking_steps() ? max_local_count(s) : 0);
     }
     double delta = currentSeconds() - start;
     done(s);
@@ -1,3 +1,6 @@
+#include <inttypes.h>
+#include <limits.h>
+
 #include "crun.h"
 #include "assert.h"
 
@@ -68,13 +71,27 @@ static state_t *new_rats(graph_t *g, int nrat, random_t global_seed) {
     ok = ok && s->node_weight != NULL;
     s->sum_weight = double_alloc(g->nnode);
     ok = ok && s->sum_weight != NULL;
-    s->neighbor_accum_weight = double_alloc(g->nnode + g->nedge);
+    // Only covers the adjacency lists this process holds
+    s->neighbor_accum_weight = double_alloc(g->neighbor_start[g->nnode]);
     ok = ok && s->neighbor_accum_weight != NULL;
 
     if (!ok) {
 	    outmsg("Couldn't allocate space for %d rats", nrat);
 	    return NULL;
     }
+    s->rebalance_interval = 0;
+    s->display_tile = 0;
+    s->display_stats = false;
+    s->display_hash = 0;
+    s->standalone = false;
+    s->validate = false;
+    s->shadow = NULL;
+    s->check_trace = false;
+    s->trace_file = NULL;
+    s->diverged = false;
+#if MPI
+    s->shared_exchange = false;
+#endif
     return s;
 }
 
@@ -154,27 +171,355 @@ state_t *read_rats(graph_t *g, FILE *infile, random_t global_seed) {
     return s;
 }
 
+/* Initialize simulation state with rats at given positions, as generated rather than read from file */
+state_t *place_rats(graph_t *g, int *position, int nrat, random_t global_seed) {
+    state_t *s = new_rats(g, nrat, global_seed);
+    if (s == NULL)
+	return NULL;
+    memcpy(s->rat_position, position, nrat * sizeof(int));
+    seed_rats(s);
+    outmsg("Generated %d rats\n", nrat);
+    return s;
+}
+
 /* print state of nodes */
 void show(state_t *s, bool show_counts) {
-    int nid;
     graph_t *g = s->g;
-    printf("STEP %d %d %d\n", g->width, g->height, s->nrat);
-    if (show_counts) {
-	    for (nid = 0; nid < g->nnode; nid++)
-		printf("%d\n", s->rat_count[nid]);
+    emit_frame(g->width, g->height, s->nrat, show_counts ? s->rat_count : NULL);
+}
+
+/*
+  Downsampled state, for monitoring large runs.  Frames have the usual
+  format, with each tile shown as a node holding the total count of its
+  nodes.  Under MPI, each process sums over its own zone and the tiles are
+  combined on process 0.
+*/
+void show_tiles(state_t *s, bool show_counts) {
+    graph_t *g = s->g;
+    int tile = s->display_tile;
+    int twidth = (g->width + tile - 1) / tile;
+    int theight = (g->height + tile - 1) / tile;
+    int ntile = twidth * theight;
+    static int *tile_count = NULL;
+    int idx;
+
+    if (!show_counts) {
+#if MPI
+	if (g->this_zone != 0)
+	    return;
+#endif
+	emit_frame(twidth, theight, s->nrat, NULL);
+	return;
+    }
+    if (tile_count == NULL) {
+	tile_count = int_alloc(ntile);
+	if (tile_count == NULL) {
+	    outmsg("Couldn't allocate space for tiles");
+	    exit(1);
+	}
+    }
+    memset(tile_count, 0, ntile * sizeof(int));
+#if MPI
+    for (idx = 0; idx < g->local_node_count; idx++) {
+	int nid = g->local_node_list[idx];
+	int x = nid % g->width;
+	int y = nid / g->width;
+	tile_count[(y / tile) * twidth + x / tile] += s->rat_count[nid];
+    }
+    START_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+    MPI_Reduce(g->this_zone == 0 ? MPI_IN_PLACE : tile_count, tile_count, ntile,
+	       MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    FINISH_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+    if (g->this_zone != 0)
+	return;
+#else
+    for (idx = 0; idx < g->nnode; idx++) {
+	int x = idx % g->width;
+	int y = idx / g->width;
+	tile_count[(y / tile) * twidth + x / tile] += s->rat_count[idx];
+    }
+#endif
+    emit_frame(twidth, theight, s->nrat, tile_count);
+}
+
+/*
+  Summary statistics, as a single line:
+    STATS step max mean stddev occupied h0 h1 ...
+  where h0 is the number of empty nodes and hk for k > 0 the number of
+  nodes with counts in [2^(k-1), 2^k), up to the last nonempty bucket.
+  Under MPI, each process summarizes its own zone and the partial results
+  are combined on process 0.
+*/
+void show_stats(state_t *s, int step) {
+    graph_t *g = s->g;
+    /* Sum, sum of squares, occupied nodes, then histogram */
+    long long partial[3 + STAT_BUCKETS];
+    int max = 0;
+    int idx, b;
+
+    memset(partial, 0, sizeof(partial));
+#if MPI
+    int count = g->local_node_count;
+#else
+    int count = g->nnode;
+#endif
+    for (idx = 0; idx < count; idx++) {
+#if MPI
+	int nid = g->local_node_list[idx];
+#else
+	int nid = idx;
+#endif
+	int c = s->rat_count[nid];
+	if (c > max)
+	    max = c;
+	partial[0] += c;
+	partial[1] += (long long) c * c;
+	partial[2] += c > 0;
+	/* Bucket is number of significant bits */
+	b = 0;
+	while (c > 0 && b < STAT_BUCKETS - 1) {
+	    b++;
+	    c >>= 1;
+	}
+	partial[3 + b]++;
+    }
+#if MPI
+    START_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+    bool master = g->this_zone == 0;
+    MPI_Reduce(master ? MPI_IN_PLACE : partial, partial, 3 + STAT_BUCKETS,
+	       MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(master ? MPI_IN_PLACE : &max, &max, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+    FINISH_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+    if (!master)
+	return;
+#endif
+    double mean = (double) partial[0] / g->nnode;
+    double var = (double) partial[1] / g->nnode - mean * mean;
+    int last = STAT_BUCKETS - 1;
+    while (last > 0 && partial[3 + last] == 0)
+	last--;
+    printf("STATS %d %d %.3f %.3f %lld", step, max, mean, var > 0 ? sqrt(var) : 0.0, partial[2]);
+    for (b = 0; b <= last; b++)
+	printf(" %lld", partial[3 + b]);
+    printf("\n");
+}
+
+/* Finalizer from splitmix64.  Scrambles all bits of x */
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/*
+  State hash.  The sum, modulo 2^64, of a scrambled term for every
+  (node, count) pair, plus at level 2 for every (rat, node) pair.  Sums
+  don't depend on order, so each process hashes its own zone and the
+  results are added together on process 0.
+*/
+uint64_t hash_state(state_t *s, int level) {
+    graph_t *g = s->g;
+    uint64_t hash = 0;
+    int idx, rid;
+
+    for (idx = 0; idx < g->local_node_count; idx++) {
+	int nid = g->local_node_list[idx];
+	hash += mix64(((uint64_t) nid << 32) | (uint32_t) s->rat_count[nid]);
+    }
+    if (level > 1) {
+	for (rid = 0; rid < s->nrat; rid++) {
+	    if (!s->zone_rat_bitvector[rid])
+		continue;
+	    hash += mix64((((uint64_t) rid << 32) | (uint32_t) s->rat_position[rid]) ^ 0x9e3779b97f4a7c15ULL);
+	}
+    }
+#if MPI
+    if (s->standalone)
+	return hash;
+    START_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+    bool master = g->this_zone == 0;
+    MPI_Reduce(master ? MPI_IN_PLACE : &hash, &hash, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    FINISH_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+#endif
+    return hash;
+}
+
+/* Print single line:  HASH step value */
+void show_hash(state_t *s, int step) {
+    uint64_t hash = hash_state(s, s->display_hash);
+#if MPI
+    if (s->g->this_zone != 0)
+	return;
+#endif
+    printf("HASH %d %016" PRIx64 "\n", step, hash);
+}
+
+/*
+  Compare with trace, as printed by an earlier run with -H.  The trace
+  must have been generated at the same hash level (-H), or level 2
+  Only the first divergence is reported.
+*/
+void check_trace(state_t *s, int step) {
+    char linebuf[MAXLINE];
+    int tstep;
+    uint64_t thash;
+    uint64_t hash = hash_state(s, s->display_hash > 0 ? s->display_hash : 2);
+#if MPI
+    if (s->g->this_zone != 0)
+	return;
+#endif
+    if (s->diverged)
+	return;
+    linebuf[0] = '\0';
+    while (fgets(linebuf, MAXLINE, s->trace_file) != NULL) {
+	if (sscanf(linebuf, "HASH %d %" SCNx64, &tstep, &thash) == 2)
+	    break;
+	linebuf[0] = '\0';
+    }
+    if (linebuf[0] == '\0') {
+	outmsg("Validation failed.  Trace ends before step %d\n", step);
+	s->diverged = true;
+    } else if (tstep != step || thash != hash) {
+	outmsg("Validation failed.  Step %d has hash %016" PRIx64 ".  Trace has step %d with hash %016" PRIx64 "\n",
+	       step, hash, tstep, thash);
+	s->diverged = true;
     }
-    printf("END\n");
 }
 
 /* Print final output */
 void done(state_t *s) {
+    finish_writer();
 #if MPI
-    if (s == NULL || s->g->this_zone != 0)
-	return;
+    if (s != NULL && shared_output_active())
+	close_shared_output(s);
+    else if (s != NULL && s->g->this_zone == 0)
+	write_done();
+    /* Collective.  Must follow anything that reads the shared counts */
+    free_shared_exchange(s);
+#else
+    write_done();
 #endif
-    printf("DONE\n");
 }
 
+/* List the rats and the nodes of this zone */
+static void index_zone(state_t *s) {
+    int ri, nid;
+    int count = 0;
+    for (ri = 0; ri < s->nrat; ri++) {
+        if (s->zone_rat_bitvector[ri]) {
+            s->zone_rat_list[count] = ri;
+            count++;
+        }
+    }
+    int num1 = 0;
+    for (nid = 0; nid < s->g->nnode; nid++) {
+        if (s->g->zone_id[nid] == s->g->this_zone) {
+            s->zone_node_id[num1] = nid;
+            num1++;
+        }
+    }
+}
+
+/*
+  Allocate the buffers for exchanging boundary values with each zone.
+  These are sized by the import and export lists of the zone, and so
+  must be reallocated whenever the zone changes.  Fresh buffers are zeroed,
+  which is also the starting point for encoding changed counts.
+*/
+static bool alloc_exchange_buffers(state_t *s) {
+    graph_t *g = s->g;
+    bool ok = true;
+    int zi;
+    for (zi = 0; zi < g->nzone; zi++) {
+        int icount = g->import_node_count[zi];
+        int ecount = g->export_node_count[zi];
+        s->import_node_state[zi] = NULL;
+        s->export_node_state[zi] = NULL;
+        s->import_node_delta[zi] = NULL;
+        s->export_node_delta[zi] = NULL;
+        s->import_node_weight[zi] = NULL;
+        s->export_node_weight[zi] = NULL;
+        if (icount > 0) {
+            s->import_node_state[zi] = int_alloc(icount);
+            s->import_node_delta[zi] = int_alloc(icount);
+            s->import_node_weight[zi] = double_alloc(icount);
+            ok = ok &&
+                 (s->import_node_state[zi] != NULL) &&
+                 (s->import_node_delta[zi] != NULL) &&
+                 (s->import_node_weight[zi] != NULL);
+        }
+        if (ecount > 0) {
+            s->export_node_state[zi] = int_alloc(ecount);
+            s->export_node_delta[zi] = int_alloc(ecount);
+            s->export_node_weight[zi] = double_alloc(ecount);
+            ok = ok &&
+                 (s->export_node_state[zi] != NULL) &&
+                 (s->export_node_delta[zi] != NULL) &&
+                 (s->export_node_weight[zi] != NULL);
+        }
+    }
+    return ok;
+}
+
+#if MPI
+/* Release the buffers for exchanging boundary values */
+static void free_exchange_buffers(state_t *s) {
+    int zi;
+    for (zi = 0; zi < s->g->nzone; zi++) {
+        free(s->import_node_state[zi]);
+        free(s->export_node_state[zi]);
+        free(s->import_node_delta[zi]);
+        free(s->export_node_delta[zi]);
+        free(s->import_node_weight[zi]);
+        free(s->export_node_weight[zi]);
+    }
+}
+
+/*
+  Tell process 0 which nodes each zone will send counts for when it
+  displays the state.  Must be called by all processes whenever the zones
+  are set up.  Process 0 already has counts for its own nodes.
+*/
+static bool register_display_nodes(state_t *s) {
+    graph_t *g = s->g;
+    int nzone = g->nzone;
+    int this_zone = g->this_zone;
+    int send_count = this_zone == 0 ? 0 : g->local_node_count;
+    int zi;
+
+    free(s->display_count);
+    s->display_count = NULL;
+    if (this_zone != 0) {
+        MPI_Gather(&send_count, 1, MPI_INT, NULL, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        MPI_Gatherv(g->local_node_list, send_count, MPI_INT,
+                    NULL, NULL, NULL, MPI_INT, 0, MPI_COMM_WORLD);
+        s->display_count = int_alloc(send_count + 1);
+        return s->display_count != NULL;
+    }
+    if (s->display_zone_count == NULL) {
+        s->display_zone_count = int_alloc(nzone);
+        s->display_zone_offset = int_alloc(nzone);
+        s->display_node_id = int_alloc(g->nnode);
+        if (s->display_zone_count == NULL || s->display_zone_offset == NULL ||
+            s->display_node_id == NULL)
+            return false;
+    }
+    MPI_Gather(&send_count, 1, MPI_INT, s->display_zone_count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    int total = 0;
+    for (zi = 0; zi < nzone; zi++) {
+        s->display_zone_offset[zi] = total;
+        total += s->display_zone_count[zi];
+    }
+    MPI_Gatherv(NULL, 0, MPI_INT, s->display_node_id, s->display_zone_count,
+                s->display_zone_offset, MPI_INT, 0, MPI_COMM_WORLD);
+    s->display_count = int_alloc(total + 1);
+    return s->display_count != NULL;
+}
+#endif
+
 //TODO: Write function to initialize zone
 bool init_zone(state_t *s, int zid) {
 
@@ -188,28 +533,19 @@ bool init_zone(state_t *s, int zid) {
     s->export_rat_info = calloc(nzone, sizeof(int*));
     ok = ok && s->export_rat_info != NULL;
 
-    s->import_nid = calloc(nzone, sizeof(int*));
-    ok = ok && s->import_nid != NULL;
-    s->export_nid = calloc(nzone, sizeof(int*));
-    ok = ok && s->export_nid != NULL;
-
     //s->import_numrats = int_alloc(nzone);
     //ok = ok && s->import_numrats != NULL;
     s->export_numrats = int_alloc(nzone);
     ok = ok && s->export_numrats != NULL;
 
-    s->import_rat_count = calloc(nzone, sizeof(int*));
-    ok = ok && s->import_rat_count != NULL;
-
-
-
-    s->export_rat_count = calloc(nzone, sizeof(int*));
-    ok = ok && s->export_rat_count != NULL;
-
     s->import_node_state = calloc(nzone, sizeof(int*));
     ok = ok && s->import_node_state != NULL;
     s->export_node_state = calloc(nzone, sizeof(int*));
     ok = ok && s->export_node_state != NULL;
+    s->import_node_delta = calloc(nzone, sizeof(int*));
+    ok = ok && s->import_node_delta != NULL;
+    s->export_node_delta = calloc(nzone, sizeof(int*));
+    ok = ok && s->export_node_delta != NULL;
 
     s->import_node_weight = calloc(nzone, sizeof(double *));
     ok = ok && s->import_node_weight != NULL;
@@ -220,69 +556,64 @@ bool init_zone(state_t *s, int zid) {
     ok = ok && s->zone_rat_list != NULL;
 
     s->zone_node_id = calloc(nnode, sizeof(int));
-    s->export_node_id = calloc(nnode, sizeof(int));
-    s->export_node_count = calloc(nnode, sizeof(int));
+    s->display_zone_count = NULL;
+    s->display_zone_offset = NULL;
+    s->display_node_id = NULL;
+    s->display_count = NULL;
 
     s->zone_rat_bitvector = calloc(nrat, sizeof(unsigned char));
     ok = ok && s->zone_rat_bitvector != NULL;
 
+    if (!ok) return false;
+
     int i;
     int num = s->batch_size;
-    // int local_nnode = s->g->local_node_count;
     for (i=0; i<nzone; i++) {
         s->import_rat_info[i] = int_alloc(num * 3);
         s->export_rat_info[i] = int_alloc(num * 3);
 
-        s->import_nid[i] = int_alloc(nnode);
-        s->export_nid[i] = int_alloc(nnode);
-
-        s->import_node_state[i] = int_alloc(nnode);
-        s->export_node_state[i] = int_alloc(nnode);
-
-        s->export_rat_count[i] = int_alloc(nnode);
-        s->import_rat_count[i] = int_alloc(nnode);
-        s->import_node_weight[i] = double_alloc(nnode);
-        s->export_node_weight[i] = double_alloc(nnode);
-
         ok = ok && 
              (s->import_rat_info[i] != NULL) && 
-             (s->export_rat_info[i] != NULL) &&
-             (s->import_rat_count[i] != NULL) &&
-             (s->export_rat_count[i] != NULL) &&
-             (s->import_node_state[i] != NULL) &&
-             (s->export_node_state[i] != NULL) &&
-             (s->import_node_weight[i] != NULL) &&
-             (s->export_node_weight[i] != NULL);
+             (s->export_rat_info[i] != NULL);
     }
+    ok = ok && alloc_exchange_buffers(s);
 
     if (!ok) return false;
 
-    int ri, nid;
-    int count = 0;
+    int ri;
 
+    // Processes holding only their own zone have no positions for other rats
     for (ri=0; ri<nrat; ri++) {
         int ni = s->rat_position[ri];
-        if (s->g->zone_id[ni] == zid) {
-            s->zone_rat_list[count] = ri;
+        if (ni >= 0 && s->g->zone_id[ni] == zid) {
             s->zone_rat_bitvector[ri] = 1;
-            count++;
-        }
-    }
-    int num1 = 0;
-    for(nid = 0; nid < nnode; nid++){
-        if(s->g->zone_id[nid]==s->g->this_zone){
-            s->zone_node_id[num1] = nid;
-            num1++;
         }
     }
-
-
+    index_zone(s);
+#if MPI
+    if (!s->standalone)
+        ok = register_display_nodes(s);
+#endif
     
-    return true;
+    return ok;
 }
 
 //TODO: Implement these communication-support functions
 #if MPI
+/* Is zone zi read through the shared window rather than by message? */
+static inline bool on_this_host(state_t *s, int zi) {
+    return s->shared_exchange && s->node_rank[zi] >= 0;
+}
+
+/* Make our stores visible to, and their stores visible from, the other processes on this host */
+static void sync_shared_window(state_t *s) {
+    START_ACTIVITY(ACTIVITY_WAIT);
+    MPI_Win_sync(s->node_win);
+    MPI_Barrier(s->node_comm);
+    MPI_Win_sync(s->node_win);
+    FINISH_ACTIVITY(ACTIVITY_WAIT);
+}
+
 /* Called by process 0 to distribute rat state to all nodes */
 void send_rats(state_t *s) {
     int nrat = s->nrat;
@@ -326,77 +657,326 @@ state_t *get_rats(graph_t *g, random_t global_seed) {
     return s;
 }
 
-/* Called by process 0 to collect node states from all other processes */
-void gather_node_state(state_t *s) {
-    int zi, i;
-    int nzone = s->g->nzone;
-    int nnode = s->g->nnode;
-    MPI_Status status[nzone];
+/*
+  Distribute only the rats residing in each zone, as (rid, nid, seed)
+  triples.  Other processes mark the positions of all other rats as -1.
+  Process 0 keeps the complete rat state.
+*/
+void send_zone_rats(state_t *s) {
     graph_t *g = s->g;
-    int count;
+    int nzone = g->nzone;
+    int nrat = s->nrat;
+    int pack_size[nzone], pack_offset[nzone];
+    int rid, zi;
 
-    int* import_numrats = int_alloc(s->g->nzone * sizeof(int));
-    memset(import_numrats, 0, g->nzone * sizeof(int)); 
-    
+    START_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+
+    MPI_Bcast(&nrat, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    memset(pack_size, 0, nzone * sizeof(int));
+    for (rid = 0; rid < nrat; rid++) {
+	zi = g->zone_id[s->rat_position[rid]];
+	if (zi != 0)
+	    pack_size[zi] += 3;
+    }
+    int total = 0;
+    for (zi = 0; zi < nzone; zi++) {
+	pack_offset[zi] = total;
+	total += pack_size[zi];
+    }
+    int *pack = int_alloc(total + 1);
+    if (pack == NULL) {
+	outmsg("Couldn't allocate space to distribute rats");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int fill[nzone];
+    memcpy(fill, pack_offset, nzone * sizeof(int));
+    for (rid = 0; rid < nrat; rid++) {
+	int nid = s->rat_position[rid];
+	zi = g->zone_id[nid];
+	if (zi == 0)
+	    continue;
+	pack[fill[zi]++] = rid;
+	pack[fill[zi]++] = nid;
+	pack[fill[zi]++] = (int) s->rat_seed[rid];
+    }
+    MPI_Scatter(pack_size, 1, MPI_INT, MPI_IN_PLACE, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Scatterv(pack, pack_size, pack_offset, MPI_INT, MPI_IN_PLACE, 0, MPI_INT, 0, MPI_COMM_WORLD);
+    free(pack);
 
+    FINISH_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+}
 
-    //START_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+/* Called by other processes to get the rats in their zones */
+state_t *get_zone_rats(graph_t *g, random_t global_seed) {
+    int nrat = 0;
+    int size = 0;
+    int ri;
 
-    /* Your code should go here */
+    START_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+    MPI_Bcast(&nrat, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    state_t *s = new_rats(g, nrat, global_seed);
+    MPI_Scatter(NULL, 1, MPI_INT, &size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    int *pack = int_alloc(size + 1);
+    if (s == NULL || pack == NULL) {
+	outmsg("Couldn't allocate space to receive rats");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Scatterv(NULL, NULL, NULL, MPI_INT, pack, size, MPI_INT, 0, MPI_COMM_WORLD);
+    FINISH_ACTIVITY(ACTIVITY_GLOBAL_COMM);
 
+    for (ri = 0; ri < nrat; ri++)
+	s->rat_position[ri] = -1;
+    for (ri = 0; ri < size; ri += 3) {
+	int rid = pack[ri];
+	s->rat_position[rid] = pack[ri+1];
+	s->rat_seed[rid] = (random_t) pack[ri+2];
+    }
+    free(pack);
+    return s;
+}
 
+/*
+  Parallel loading.  Each process reads its own byte range of the file with
+  collective MPI-IO and keeps the lines that start within that range,
+  reading up to MAXLINE bytes past the range to finish its last line.
+  Returns the lines as a single null-terminated string, or NULL if
+  something goes wrong.
+*/
+char *read_chunk(char *fname) {
+    MPI_File fh;
+    MPI_Offset fsize;
+    int process_count, this_zone;
+    MPI_Comm_size(MPI_COMM_WORLD, &process_count);
+    MPI_Comm_rank(MPI_COMM_WORLD, &this_zone);
+    if (MPI_File_open(MPI_COMM_WORLD, fname, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+	outmsg("Couldn't open file %s\n", fname);
+	return NULL;
+    }
+    MPI_File_get_size(fh, &fsize);
+    MPI_Offset start = fsize * this_zone / process_count;
+    MPI_Offset end = fsize * (this_zone+1) / process_count;
+    /* Also read the byte before our range, to see whether a line starts at its beginning */
+    MPI_Offset lo = start > 0 ? start-1 : 0;
+    MPI_Offset hi = end + MAXLINE < fsize ? end + MAXLINE : fsize;
+    size_t len = (size_t) (hi - lo);
+    char *buf = malloc(len + 1);
+    if (buf == NULL) {
+	outmsg("Couldn't allocate space to read file %s\n", fname);
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    /*
+      Counts are ints, so read in pieces of at most INT_MAX bytes.  Reads
+      are collective, so every process makes as many calls as the one
+      with the largest chunk
+    */
+    long npiece = (long) ((len + INT_MAX - 1) / INT_MAX);
+    long max_npiece;
+    MPI_Allreduce(&npiece, &max_npiece, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Offset cursor = lo;
+    long p;
+    for (p = 0; p < max_npiece; p++) {
+	MPI_Offset left = hi - cursor;
+	int count = left > INT_MAX ? INT_MAX : (int) left;
+	MPI_File_read_at_all(fh, cursor, buf + (cursor - lo), count, MPI_CHAR, MPI_STATUS_IGNORE);
+	cursor += count;
+    }
+    MPI_File_close(&fh);
+    buf[len] = '\0';
+
+    size_t first = (size_t) (start - lo);
+    if (start > 0)
+	while (first < len && buf[first-1] != '\n')
+	    first++;
+    size_t pos = first;
+    while (pos < (size_t) (end - lo)) {
+	char *nl = memchr(buf + pos, '\n', len - pos);
+	if (nl == NULL) {
+	    if (hi < fsize) {
+		outmsg("Line longer than %d characters in file %s\n", MAXLINE, fname);
+		free(buf);
+		return NULL;
+	    }
+	    pos = len;
+	} else
+	    pos = nl - buf + 1;
+    }
+    memmove(buf, buf + first, pos - first);
+    buf[pos - first] = '\0';
+    return buf;
+}
 
-    for (zi = 1; zi < nzone; zi++){ //goes through all the processes
-        MPI_Probe(zi, 3*zi+1, MPI_COMM_WORLD, &(status[zi]));
-        MPI_Get_count(&(status[zi]), MPI_INT, &(count));
+/* Split off next line of chunk, advancing *pos past it.  Return NULL at end */
+char *chunk_line(char **pos) {
+    char *line = *pos;
+    if (*line == '\0')
+	return NULL;
+    char *nl = strchr(line, '\n');
+    if (nl == NULL)
+	*pos = line + strlen(line);
+    else {
+	*nl = '\0';
+	*pos = nl + 1;
+    }
+    return line;
+}
 
-        MPI_Recv(s->export_node_id, count, MPI_INT, zi, 3*zi+1, MPI_COMM_WORLD, MPI_STATUS_IGNORE); 
-        MPI_Recv(s->export_node_count, count, MPI_INT, zi, 3*zi+2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);  
+/* Combine success flags from all processes */
+bool all_ok(bool ok) {
+    int iok = ok;
+    MPI_Allreduce(MPI_IN_PLACE, &iok, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    return iok != 0;
+}
 
-        for (i = 0; i < count; i++) {
-            s->rat_count[s->export_node_id[i]]= s->export_node_count[i];
-        }      
-    }   
+/*
+  Load rat file in parallel.  Every process parses its chunk, numbering
+  its rats from the count of lines in preceding chunks, and sends each
+  rat to the process owning its node.  As with get_zone_rats, other rats
+  have position -1.  Requires graph with zone ids for all nodes.
+*/
+state_t *load_rats(graph_t *g, char *fname, random_t global_seed) {
+    int nzone = g->nzone;
+    int this_zone;
+    int nline = 0;
+    int offset = 0;
+    int header[2] = {-1, -1};
+    int zi, ri;
+    char *line, *pos;
+    MPI_Comm_rank(MPI_COMM_WORLD, &this_zone);
 
-    // MPI_Waitall(len, request, MPI_STATUS_IGNORE);
-    
-    // for(i = 0; i < nnode; i++){
-    //     int* zone_id_list = g->zone_id;
-    //     int zid = zone_id_list[i]; // zone that the node is in
-    //     if (zid != 0) {
-    //         s->rat_count[i] = (s->import_rat_count)[zid][i];
-    //     }
-    // }
+    char *text = read_chunk(fname);
+    if (!all_ok(text != NULL)) {
+	free(text);
+	return NULL;
+    }
+    /* Global index of our first line, not counting comments.  Index 0 is the header */
+    pos = text;
+    char *scan = text;
+    while ((line = chunk_line(&scan)) != NULL)
+	if (!is_comment(line))
+	    nline++;
+    MPI_Exscan(&nline, &offset, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (this_zone == 0)
+	offset = 0;
+    bool ok = true;
+    int index = offset;
+    int *nids = int_alloc(nline + 1);
+    int count = 0;
+    /* Lines were split in place by the first pass */
+    while (pos < scan) {
+	line = pos;
+	pos += strlen(line) + 1;
+	if (is_comment(line))
+	    continue;
+	if (index == 0) {
+	    if (sscanf(line, "%d %d", &header[0], &header[1]) != 2) {
+		outmsg("ERROR. Malformed rat file header (line 1)\n");
+		ok = false;
+	    }
+	} else if (sscanf(line, "%d", &nids[count++]) != 1) {
+	    outmsg("Error in rat file.  Line %d\n", index+1);
+	    ok = false;
+	}
+	index++;
+    }
+    free(text);
+    MPI_Allreduce(MPI_IN_PLACE, header, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    int nnode = header[0];
+    int nrat = header[1];
+    MPI_Allreduce(MPI_IN_PLACE, &nline, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    ok = all_ok(ok);
+    if (ok && nnode != g->nnode) {
+	if (this_zone == 0)
+	    outmsg("Graph contains %d nodes, but rat file has %d\n", g->nnode, nnode);
+	ok = false;
+    } else if (ok && nline - 1 < nrat) {
+	if (this_zone == 0)
+	    outmsg("Error in rat file.  Line %d\n", nline+1);
+	ok = false;
+    }
+    /* Rat ids, and line numbers, follow from the index of the first rat line */
+    int first_rid = offset > 0 ? offset - 1 : 0;
+    int send_count[nzone], send_offset[nzone];
+    int recv_count[nzone], recv_offset[nzone];
+    memset(send_count, 0, nzone * sizeof(int));
+    for (ri = 0; ok && ri < count; ri++) {
+	int nid = nids[ri];
+	if (first_rid + ri >= nrat)
+	    break;
+	if (nid < 0 || nid >= nnode) {
+	    outmsg("ERROR.  Line %d.  Invalid node number %d\n", first_rid + ri + 2, nid);
+	    ok = false;
+	} else
+	    send_count[g->zone_id[nid]] += 2;
+    }
+    if (!all_ok(ok)) {
+	free(nids);
+	return NULL;
+    }
 
-    // MPI_Status status[nzone];
-    // int *import_rat
+    /* Send (rid, nid) pairs to the owning zones.  Seeds are derived from rat ids */
+    MPI_Alltoall(send_count, 1, MPI_INT, recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+    int send_total = 0;
+    int recv_total = 0;
+    for (zi = 0; zi < nzone; zi++) {
+	send_offset[zi] = send_total;
+	send_total += send_count[zi];
+	recv_offset[zi] = recv_total;
+	recv_total += recv_count[zi];
+    }
+    int *send_buf = int_alloc(send_total + 1);
+    int *recv_buf = int_alloc(recv_total + 1);
+    state_t *s = new_rats(g, nrat, global_seed);
+    if (s == NULL || send_buf == NULL || recv_buf == NULL) {
+	outmsg("Couldn't allocate space for rats");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int fill[nzone];
+    memcpy(fill, send_offset, nzone * sizeof(int));
+    for (ri = 0; ri < count && first_rid + ri < nrat; ri++) {
+	zi = g->zone_id[nids[ri]];
+	send_buf[fill[zi]++] = first_rid + ri;
+	send_buf[fill[zi]++] = nids[ri];
+    }
+    free(nids);
+    MPI_Alltoallv(send_buf, send_count, send_offset, MPI_INT,
+		  recv_buf, recv_count, recv_offset, MPI_INT, MPI_COMM_WORLD);
+    for (ri = 0; ri < nrat; ri++)
+	s->rat_position[ri] = -1;
+    for (ri = 0; ri < recv_total; ri += 2)
+	s->rat_position[recv_buf[ri]] = recv_buf[ri+1];
+    free(send_buf);
+    free(recv_buf);
+
+    seed_rats(s);
+    if (this_zone == 0)
+	outmsg("Loaded %d rats\n", nrat);
+    return s;
+}
 
-    //FINISH_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+/* Called by process 0 to collect node states from all other processes */
+void gather_node_state(state_t *s) {
+    graph_t *g = s->g;
+    int total = s->display_zone_offset[g->nzone-1] + s->display_zone_count[g->nzone-1];
+    int i;
 
+    START_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+    MPI_Gatherv(NULL, 0, MPI_INT, s->display_count, s->display_zone_count,
+                s->display_zone_offset, MPI_INT, 0, MPI_COMM_WORLD);
+    for (i = 0; i < total; i++)
+        s->rat_count[s->display_node_id[i]] = s->display_count[i];
+    FINISH_ACTIVITY(ACTIVITY_GLOBAL_COMM);
 }
 
 /* Called by other processes to send their node states to process 0 */
 void send_node_state(state_t *s) {
-    START_ACTIVITY(ACTIVITY_GLOBAL_COMM);
-    /* Your code should go here */
-    int i, ni, zi;
     graph_t *g = s->g;
-    int nnode = g->nnode;
-    zi = g->this_zone;
-
-    int count = 0;
-    for (i=0; i<g->local_node_count; i++) {
-        ni = s->zone_node_id[i];
-        s->export_node_id[count] = ni;
-        s->export_node_count[count] = s->rat_count[ni];
-        count++;
-    }
-    
-    //MPI_Request request[(g->nzone) * 2];
+    int count = g->local_node_count;
+    int i;
 
-    MPI_Send(s->export_node_id, count, MPI_INT, 0, 3*s->g->this_zone+1, MPI_COMM_WORLD);
-    MPI_Send(s->export_node_count, count, MPI_INT, 0, 3*s->g->this_zone+2, MPI_COMM_WORLD);
-    
+    START_ACTIVITY(ACTIVITY_GLOBAL_COMM);
+    for (i = 0; i < count; i++)
+        s->display_count[i] = s->rat_count[g->local_node_list[i]];
+    MPI_Gatherv(s->display_count, count, MPI_INT, NULL, NULL, NULL, MPI_INT, 0, MPI_COMM_WORLD);
     FINISH_ACTIVITY(ACTIVITY_GLOBAL_COMM);
 }
 
@@ -423,6 +1003,8 @@ void exchange_rats(state_t *s) {
         // MPI_Isend(&(s->export_numrats[zi]), 1, MPI_INT, zi, zi*2, MPI_COMM_WORLD, &(request[zi*2]));
         // if (export_numrats != 0) {                    
         MPI_Isend(s->export_rat_info[zi], export_numrats * 3, MPI_INT, zi, zi, MPI_COMM_WORLD, &(request[zi]));
+        RECORD_MESSAGE(true, zi, export_numrats * 3 * sizeof(int));
+        RECORD_RATS(zi, export_numrats);
         // }
     }
     
@@ -434,6 +1016,7 @@ void exchange_rats(state_t *s) {
         //int probe_ncount;
 
         // probe size of the message
+        START_ACTIVITY(ACTIVITY_WAIT);
         MPI_Probe(zi, this_zone, MPI_COMM_WORLD, &(status[zi]));
         MPI_Get_count(&(status[zi]), MPI_INT, &(probe_ncount[zi]));
 
@@ -444,6 +1027,8 @@ void exchange_rats(state_t *s) {
 
         // if (import_numrats != 0) {
         MPI_Recv(s->import_rat_info[zi], probe_ncount[zi], MPI_INT, zi, this_zone, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        FINISH_ACTIVITY(ACTIVITY_WAIT);
+        RECORD_MESSAGE(false, zi, probe_ncount[zi] * sizeof(int));
         // }
     }
 
@@ -451,6 +1036,7 @@ void exchange_rats(state_t *s) {
     // int old_rat_count = s->zone_rat_count;
     int rid, nid, R;
     random_t seed;
+    START_ACTIVITY(ACTIVITY_UNPACK);
     for (zi = 0; zi < nzone; zi++) {
         
         // only read from other zones' import buffer
@@ -475,17 +1061,26 @@ void exchange_rats(state_t *s) {
             }
         }
     }
+    FINISH_ACTIVITY(ACTIVITY_UNPACK);
 
 
     FINISH_ACTIVITY(ACTIVITY_COMM);
 }
 
-/* Exchange node counts for boundary nodes between zones */
+/*
+  Exchange node counts for boundary nodes between zones.
+
+  Usually only a few boundary counts change in a batch, so each message
+  holds just the (index, count) pairs that differ from the previous
+  exchange.  When at least half of the boundary has changed, the full
+  list of counts is cheaper and gets sent instead.  The receiver tells
+  the two apart by message length: a full list has exactly ncount
+  entries, while a list of pairs is always shorter.
+*/
 void exchange_node_states(state_t *s) {
     START_ACTIVITY(ACTIVITY_COMM);
     graph_t *g = s->g;
     int nzone = g->nzone;
-    int nnode = g->nnode;
     int this_zone = g->this_zone;
     MPI_Request request[nzone];
 
@@ -495,40 +1090,95 @@ void exchange_node_states(state_t *s) {
 
         int ncount = g->export_node_count[zi];
 
-        if (ncount == 0) continue;
+        if (ncount == 0 || on_this_host(s, zi)) continue;
 
+        int *last = s->export_node_state[zi];
+        int *delta = s->export_node_delta[zi];
+        int dcount = 0;
+        START_ACTIVITY(ACTIVITY_PACK);
         for (ni = 0; ni < ncount; ni++) {
             nid = g->export_node_list[zi][ni];
-            s->export_node_state[zi][ni] = s->rat_count[nid];
+            int count = s->rat_count[nid];
+            if (count != last[ni]) {
+                last[ni] = count;
+                if (dcount + 2 < ncount) {
+                    delta[dcount++] = ni;
+                    delta[dcount++] = count;
+                } else
+                    dcount = ncount;
+            }
         }
+        FINISH_ACTIVITY(ACTIVITY_PACK);
 
-        MPI_Isend(s->export_node_state[zi], ncount, MPI_INT, zi, zi, MPI_COMM_WORLD, &(request[zi]));
+        if (dcount < ncount)
+            MPI_Isend(delta, dcount, MPI_INT, zi, zi, MPI_COMM_WORLD, &(request[zi]));
+        else
+            MPI_Isend(last, ncount, MPI_INT, zi, zi, MPI_COMM_WORLD, &(request[zi]));
+        RECORD_MESSAGE(true, zi, (dcount < ncount ? dcount : ncount) * sizeof(int));
+    }
+
+    // read directly from zones on this host
+    if (s->shared_exchange) {
+        sync_shared_window(s);
+        for (zi = 0; zi < nzone; zi++) {
+            int ncount = g->import_node_count[zi];
+            if (ncount == 0 || !on_this_host(s, zi)) continue;
+            int *peer_count = s->peer_rat_count[zi];
+            START_ACTIVITY(ACTIVITY_UNPACK);
+            for (ni = 0; ni < ncount; ni++) {
+                nid = g->import_node_list[zi][ni];
+                s->rat_count[nid] = peer_count[nid];
+            }
+            FINISH_ACTIVITY(ACTIVITY_UNPACK);
+        }
     }
 
     // receive from all other zones (sync)
     for (zi = 0; zi < nzone; zi++) {
         int ncount = g->import_node_count[zi];
 
-        if (ncount != 0) {
-            MPI_Recv(s->import_node_state[zi], ncount, MPI_INT, zi, this_zone, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (ncount == 0 || on_this_host(s, zi)) continue;
+
+        MPI_Status status;
+        int dcount;
+        START_ACTIVITY(ACTIVITY_WAIT);
+        MPI_Probe(zi, this_zone, MPI_COMM_WORLD, &status);
+        MPI_Get_count(&status, MPI_INT, &dcount);
+
+        int *last = s->import_node_state[zi];
+        int *delta = s->import_node_delta[zi];
+        if (dcount == ncount)
+            MPI_Recv(last, ncount, MPI_INT, zi, this_zone, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        else
+            MPI_Recv(delta, dcount, MPI_INT, zi, this_zone, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        FINISH_ACTIVITY(ACTIVITY_WAIT);
+        RECORD_MESSAGE(false, zi, dcount * sizeof(int));
+        START_ACTIVITY(ACTIVITY_UNPACK);
+        if (dcount == ncount) {
+            for (ni = 0; ni < ncount; ni++) {
+                nid = g->import_node_list[zi][ni];
+                s->rat_count[nid] = last[ni];
+            }
+        } else {
+            int di;
+            for (di = 0; di < dcount; di += 2) {
+                ni = delta[di];
+                last[ni] = delta[di+1];
+                nid = g->import_node_list[zi][ni];
+                s->rat_count[nid] = last[ni];
+            }
         }
+        FINISH_ACTIVITY(ACTIVITY_UNPACK);
     }
 
+    START_ACTIVITY(ACTIVITY_WAIT);
     for (zi = 0; zi < nzone; zi++) {
         int ncount = g->export_node_count[zi];
-        if (ncount != 0) {
+        if (ncount != 0 && !on_this_host(s, zi)) {
             MPI_Wait(&(request[zi]), MPI_STATUS_IGNORE);
         }
     }
-
-
-    for (zi = 0; zi < nzone; zi++) {
-        int ncount = g->import_node_count[zi];
-        for (ni = 0; ni < ncount; ni++) {
-            nid = g->import_node_list[zi][ni];
-            s->rat_count[nid] = s->import_node_state[zi][ni];
-        }
-    }
+    FINISH_ACTIVITY(ACTIVITY_WAIT);
 
     FINISH_ACTIVITY(ACTIVITY_COMM);
 }
@@ -538,7 +1188,6 @@ void exchange_node_weights(state_t *s) {
     START_ACTIVITY(ACTIVITY_COMM);
     graph_t *g = s->g;
     int nzone = g->nzone;
-    int nnode = g->nnode;
     int this_zone = g->this_zone;
     MPI_Request request[nzone];
 
@@ -547,43 +1196,370 @@ void exchange_node_weights(state_t *s) {
     for (zi = 0; zi < nzone; zi++) {
 
         int ncount = g->export_node_count[zi];
-        if (ncount == 0) continue;
+        if (ncount == 0 || on_this_host(s, zi)) continue;
 
 
+        START_ACTIVITY(ACTIVITY_PACK);
         for (ni = 0; ni < ncount; ni++) {
             nid = g->export_node_list[zi][ni];
             s->export_node_weight[zi][ni] = s->node_weight[nid];
         }
+        FINISH_ACTIVITY(ACTIVITY_PACK);
 
         MPI_Isend(s->export_node_weight[zi], ncount, MPI_DOUBLE, zi, zi, MPI_COMM_WORLD, &(request[zi]));
+        RECORD_MESSAGE(true, zi, ncount * sizeof(double));
+    }
+
+    // read directly from zones on this host
+    if (s->shared_exchange) {
+        sync_shared_window(s);
+        for (zi = 0; zi < nzone; zi++) {
+            int ncount = g->import_node_count[zi];
+            if (ncount == 0 || !on_this_host(s, zi)) continue;
+            double *peer_weight = s->peer_node_weight[zi];
+            START_ACTIVITY(ACTIVITY_UNPACK);
+            for (ni = 0; ni < ncount; ni++) {
+                nid = g->import_node_list[zi][ni];
+                s->node_weight[nid] = peer_weight[nid];
+            }
+            FINISH_ACTIVITY(ACTIVITY_UNPACK);
+        }
     }
 
     // receive from all other zones (sync)
+    START_ACTIVITY(ACTIVITY_WAIT);
     for (zi = 0; zi < nzone; zi++) {
         int ncount = g->import_node_count[zi];
-        if (ncount != 0) {
+        if (ncount != 0 && !on_this_host(s, zi)) {
             MPI_Recv(s->import_node_weight[zi], ncount, MPI_DOUBLE, zi, this_zone, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            RECORD_MESSAGE(false, zi, ncount * sizeof(double));
         }
     }
     
 
     for (zi = 0; zi < nzone; zi++) {
         int ncount = g->export_node_count[zi];
-        if (ncount != 0) {
+        if (ncount != 0 && !on_this_host(s, zi)) {
             MPI_Wait(&(request[zi]), MPI_STATUS_IGNORE);
         }
     }
+    FINISH_ACTIVITY(ACTIVITY_WAIT);
 
+    START_ACTIVITY(ACTIVITY_UNPACK);
     for (zi = 0; zi < nzone; zi++) {
         int ncount = g->import_node_count[zi];
+        if (on_this_host(s, zi)) continue;
         for (ni = 0; ni < ncount; ni++) {
             nid = g->import_node_list[zi][ni];
             s->node_weight[nid] = s->import_node_weight[zi][ni];
         }
     }
+    FINISH_ACTIVITY(ACTIVITY_UNPACK);
 
     FINISH_ACTIVITY(ACTIVITY_COMM);
 }
+
+/*
+  Shared-window exchange.  Every process on a host places its node_weight
+  and rat_count arrays in one MPI_Win_allocate_shared window, so a zone can
+  read its neighbors' boundary values in place rather than packing them into
+  messages.  Zones on other hosts still go through exchange messages.
+
+  A single barrier per exchange suffices: between two exchanges of the same
+  array, every process passes through an exchange of the other array, so no
+  process can overwrite values that a neighbor is still reading.
+*/
+bool setup_shared_exchange(state_t *s) {
+    graph_t *g = s->g;
+    int nzone = g->nzone;
+    int nnode = g->nnode;
+    int zi;
+    MPI_Group world_group, node_group;
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &s->node_comm);
+
+    /* Find out which zones are on this host */
+    int world_rank[nzone];
+    s->node_rank = int_alloc(nzone);
+    s->peer_rat_count = calloc(nzone, sizeof(int *));
+    s->peer_node_weight = calloc(nzone, sizeof(double *));
+    if (s->node_rank == NULL || s->peer_rat_count == NULL || s->peer_node_weight == NULL) {
+	outmsg("Couldn't allocate space for shared exchange");
+	MPI_Comm_free(&s->node_comm);
+	return false;
+    }
+    for (zi = 0; zi < nzone; zi++)
+	world_rank[zi] = zi;
+    MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    MPI_Comm_group(s->node_comm, &node_group);
+    MPI_Group_translate_ranks(world_group, nzone, world_rank, node_group, s->node_rank);
+    MPI_Group_free(&world_group);
+    MPI_Group_free(&node_group);
+    for (zi = 0; zi < nzone; zi++)
+	if (s->node_rank[zi] == MPI_UNDEFINED)
+	    s->node_rank[zi] = -1;
+
+    /* Allocate our segment.  Weights first, to keep them aligned */
+    MPI_Aint seg_size = nnode * (sizeof(double) + sizeof(int));
+    char *base;
+    if (MPI_Win_allocate_shared(seg_size, 1, MPI_INFO_NULL, s->node_comm, &base, &s->node_win) != MPI_SUCCESS) {
+	outmsg("Couldn't allocate shared window");
+	MPI_Comm_free(&s->node_comm);
+	return false;
+    }
+    double *node_weight = (double *) base;
+    int *rat_count = (int *) (base + nnode * sizeof(double));
+    memcpy(node_weight, s->node_weight, nnode * sizeof(double));
+    memcpy(rat_count, s->rat_count, nnode * sizeof(int));
+    free(s->node_weight);
+    free(s->rat_count);
+    s->node_weight = node_weight;
+    s->rat_count = rat_count;
+
+    /* Map in the segments of the other zones on this host */
+    for (zi = 0; zi < nzone; zi++) {
+	if (zi == g->this_zone || s->node_rank[zi] < 0)
+	    continue;
+	MPI_Aint size;
+	int disp_unit;
+	char *peer_base;
+	MPI_Win_shared_query(s->node_win, s->node_rank[zi], &size, &disp_unit, &peer_base);
+	s->peer_node_weight[zi] = (double *) peer_base;
+	s->peer_rat_count[zi] = (int *) (peer_base + nnode * sizeof(double));
+    }
+
+    /* Keep a passive epoch open for the whole run, so that MPI_Win_sync can order memory accesses */
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, s->node_win);
+    s->shared_exchange = true;
+    return true;
+}
+
+/*
+  Release the shared window and node communicator.  Node weights and rat
+  counts move back to private memory first, so the state stays usable
+  for reporting.  Collective over all processes.
+*/
+void free_shared_exchange(state_t *s) {
+    if (s == NULL || !s->shared_exchange)
+	return;
+    int nnode = s->g->nnode;
+    double *node_weight = double_alloc(nnode);
+    int *rat_count = int_alloc(nnode);
+    if (node_weight != NULL && rat_count != NULL) {
+	memcpy(node_weight, s->node_weight, nnode * sizeof(double));
+	memcpy(rat_count, s->rat_count, nnode * sizeof(int));
+    } else {
+	outmsg("Couldn't allocate space to copy out of shared window");
+	free(node_weight);
+	free(rat_count);
+	node_weight = NULL;
+	rat_count = NULL;
+    }
+    MPI_Win_unlock_all(s->node_win);
+    MPI_Win_free(&s->node_win);
+    MPI_Comm_free(&s->node_comm);
+    s->node_weight = node_weight;
+    s->rat_count = rat_count;
+    free(s->node_rank);
+    free(s->peer_rat_count);
+    free(s->peer_node_weight);
+    s->node_rank = NULL;
+    s->peer_rat_count = NULL;
+    s->peer_node_weight = NULL;
+    s->shared_exchange = false;
+}
+
+/*
+  Dynamic load rebalancing.
+
+  The static partition only sees node and edge counts, but the work in
+  a zone is dominated by its rats (find_moves) and its edges
+  (compute_weights and compute_sums, once per batch).  Every process
+  contributes the rat counts of its regions and the time it spent in
+  these activities since the last rebalance.  From these, all processes
+  derive the same per-region cost estimates, rerun the partitioner, and
+  hand the rats of any region that changed zones to its new owner.
+*/
+bool rebalance_zones(state_t *s) {
+    graph_t *g = s->g;
+    int nzone = g->nzone;
+    int nnode = g->nnode;
+    int nrat = s->nrat;
+    int nregion = g->nregion;
+    int this_zone = g->this_zone;
+    region_t *region_list = g->region_list;
+    int ri, zi, nid, rid;
+    static double last_time[2] = {0.0, 0.0};
+
+    if (nregion == 0)
+	return false;
+
+    START_ACTIVITY(ACTIVITY_REBALANCE);
+
+    /* Rats per region.  Each region is counted by the zone that owns it */
+    double region_rats[nregion];
+    for (ri = 0; ri < nregion; ri++) {
+	region_t *r = &region_list[ri];
+	int count = 0;
+	if (r->zone_id == this_zone) {
+	    int x, y;
+	    for (y = r->y; y < r->y + r->h; y++)
+		for (x = r->x; x < r->x + r->w; x++)
+		    count += s->rat_count[y * g->width + x];
+	}
+	region_rats[ri] = (double) count;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, region_rats, nregion, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+    /* Time spent on rats and on edges since the last rebalance */
+    double now_time[2];
+    now_time[0] = activity_time(ACTIVITY_NEXT);
+    now_time[1] = activity_time(ACTIVITY_WEIGHTS) + activity_time(ACTIVITY_SUMS);
+    double zone_time[2] = {now_time[0] - last_time[0], now_time[1] - last_time[1]};
+    last_time[0] = now_time[0];
+    last_time[1] = now_time[1];
+    MPI_Allreduce(MPI_IN_PLACE, zone_time, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+    /* Cost per rat and per edge.  Without timing data, assume that every
+       rat move costs about as much as visiting one edge in each batch */
+    double total_edges = 0.0;
+    for (ri = 0; ri < nregion; ri++)
+	total_edges += region_list[ri].edge_count;
+    double rat_cost = 1.0;
+    double edge_cost = (double) (nrat + s->batch_size - 1) / s->batch_size;
+    if (zone_time[0] > 0.0 && zone_time[1] > 0.0) {
+	rat_cost = zone_time[0] / nrat;
+	edge_cost = zone_time[1] / total_edges;
+    }
+
+    double region_weight[nregion];
+    int old_zone[nregion];
+    double old_load[nzone];
+    double new_load[nzone];
+    for (zi = 0; zi < nzone; zi++) {
+	old_load[zi] = 0.0;
+	new_load[zi] = 0.0;
+    }
+    for (ri = 0; ri < nregion; ri++) {
+	region_weight[ri] = rat_cost * region_rats[ri] + edge_cost * region_list[ri].edge_count;
+	old_zone[ri] = region_list[ri].zone_id;
+	old_load[old_zone[ri]] += region_weight[ri];
+    }
+    reassign_zones(region_list, nregion, nzone, region_weight);
+    for (ri = 0; ri < nregion; ri++)
+	new_load[region_list[ri].zone_id] += region_weight[ri];
+
+    /* Only migrate when it pays off */
+    double old_max = data_max(old_load, nzone);
+    double new_max = data_max(new_load, nzone);
+    if (new_max > old_max * (1.0 - REBALANCE_GAIN)) {
+	for (ri = 0; ri < nregion; ri++)
+	    region_list[ri].zone_id = old_zone[ri];
+	FINISH_ACTIVITY(ACTIVITY_REBALANCE);
+	return false;
+    }
+
+    /* Counts for nodes outside the zone are stale, or about to be */
+    for (nid = 0; nid < nnode; nid++)
+	if (g->zone_id[nid] != this_zone)
+	    s->rat_count[nid] = 0;
+    int moved = 0;
+    for (ri = 0; ri < nregion; ri++) {
+	region_t *r = &region_list[ri];
+	if (r->zone_id == old_zone[ri])
+	    continue;
+	moved++;
+	int x, y;
+	for (y = r->y; y < r->y + r->h; y++)
+	    for (x = r->x; x < r->x + r->w; x++) {
+		nid = y * g->width + x;
+		g->zone_id[nid] = r->zone_id;
+		if (r->zone_id != this_zone)
+		    s->rat_count[nid] = 0;
+	    }
+    }
+    if (this_zone == 0)
+	outmsg("Rebalanced zones.  Moved %d regions.  Maximum zone load reduced by %.1f%%\n",
+	       moved, 100.0 * (old_max - new_max) / old_max);
+
+    /* Migrate rats whose nodes now belong to other zones.  Each rat travels as (rid, nid, seed) */
+    int send_count[nzone], send_offset[nzone];
+    int recv_count[nzone], recv_offset[nzone];
+    memset(send_count, 0, nzone * sizeof(int));
+    for (rid = 0; rid < nrat; rid++) {
+	if (!s->zone_rat_bitvector[rid])
+	    continue;
+	zi = g->zone_id[s->rat_position[rid]];
+	if (zi != this_zone)
+	    send_count[zi] += 3;
+    }
+    MPI_Alltoall(send_count, 1, MPI_INT, recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+    int send_total = 0;
+    int recv_total = 0;
+    for (zi = 0; zi < nzone; zi++) {
+	send_offset[zi] = send_total;
+	send_total += send_count[zi];
+	recv_offset[zi] = recv_total;
+	recv_total += recv_count[zi];
+    }
+    int *send_buf = int_alloc(send_total + 1);
+    int *recv_buf = int_alloc(recv_total + 1);
+    if (send_buf == NULL || recv_buf == NULL) {
+	outmsg("Couldn't allocate space for rat migration");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int fill[nzone];
+    memcpy(fill, send_offset, nzone * sizeof(int));
+    for (rid = 0; rid < nrat; rid++) {
+	if (!s->zone_rat_bitvector[rid])
+	    continue;
+	nid = s->rat_position[rid];
+	zi = g->zone_id[nid];
+	if (zi == this_zone)
+	    continue;
+	send_buf[fill[zi]++] = rid;
+	send_buf[fill[zi]++] = nid;
+	send_buf[fill[zi]++] = (int) s->rat_seed[rid];
+	s->zone_rat_bitvector[rid] = 0;
+    }
+    MPI_Alltoallv(send_buf, send_count, send_offset, MPI_INT,
+		  recv_buf, recv_count, recv_offset, MPI_INT, MPI_COMM_WORLD);
+
+    /* Every rat on a newly acquired node arrives in the migration.  Counts
+       for nodes we did not own before were cleared above */
+    for (ri = 0; ri < recv_total; ri += 3) {
+	rid = recv_buf[ri];
+	nid = recv_buf[ri+1];
+	s->rat_position[rid] = nid;
+	s->rat_seed[rid] = (random_t) recv_buf[ri+2];
+	s->zone_rat_bitvector[rid] = 1;
+	s->rat_count[nid]++;
+    }
+    free(send_buf);
+    free(recv_buf);
+
+    /*
+      Rebuild zone structures and refresh boundary counts.  The new
+      exchange buffers start out zeroed, matching the counts of nodes
+      outside the zone, so the next exchange of node states starts from a
+      consistent state.
+    */
+    free_exchange_buffers(s);
+    clear_zone(g);
+    if (!setup_zone(g, this_zone, false) || !alloc_exchange_buffers(s)) {
+	outmsg("Couldn't set up zone %d after rebalancing", this_zone);
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    index_zone(s);
+    if (!register_display_nodes(s)) {
+	outmsg("Couldn't allocate space to gather counts after rebalancing");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    FINISH_ACTIVITY(ACTIVITY_REBALANCE);
+
+    exchange_node_states(s);
+    return true;
+}
 #endif // MPI
 
 /* Function suitable for sorting arrays of int's */